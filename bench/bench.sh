@@ -0,0 +1,141 @@
+#!/bin/sh
+# Headless benchmark: runs rootclock's render and present path on a private
+# Xvfb for every monitor layout and background mode, reports frame times,
+# X requests per frame and server CPU, and compares the final frame with a
+# recorded reference image.
+#
+#   sh bench/bench.sh       measure and compare against the references
+#   sh bench/bench.sh -r    measure and (re)record the references
+#
+# Results are only comparable on the same machine, fonts and Xvfb build:
+# record the references there once and compare later commits against them.
+#
+# Environment:
+#   ROOTCLOCK      binary to run (./rootclock)
+#   BENCH_FRAMES   measured frames per run (300)
+#   BENCH_LAYOUTS  space separated HEADSxWIDTHxHEIGHT entries; heads are laid
+#                  out in a square grid, so 16x1920x1080 is an 8K screen
+#   BENCH_MODES    background modes to run (all of them)
+#   BENCH_REF      reference image directory (bench/ref)
+#   BENCH_OUT      report file (bench_output.txt)
+#   BENCH_DISPLAY  display the private server uses (:99)
+set -eu
+
+ROOTCLOCK=${ROOTCLOCK:-./rootclock}
+FRAMES=${BENCH_FRAMES:-300}
+LAYOUTS=${BENCH_LAYOUTS:-"1x1920x1080 1x7680x4320 4x1920x1080 16x1920x1080"}
+MODES=${BENCH_MODES:-"solid copy invert multiply screen overlay darken lighten"}
+REF=${BENCH_REF:-bench/ref}
+OUT=${BENCH_OUT:-bench_output.txt}
+DPY=${BENCH_DISPLAY:-:99}
+
+record=0
+if [ "${1:-}" = "-r" ]; then
+  record=1
+fi
+
+for tool in Xvfb xrandr xwd xdpyinfo; do
+  command -v "$tool" >/dev/null 2>&1 || {
+    echo "bench: $tool not found" >&2
+    exit 1
+  }
+done
+
+hz=$(getconf CLK_TCK)
+tmp=$(mktemp -d)
+xvfb=
+cleanup() {
+  [ -n "$xvfb" ] && kill "$xvfb" 2>/dev/null && wait "$xvfb" 2>/dev/null
+  rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+# user+system ticks the server has used so far
+server_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$xvfb/stat"
+}
+
+start_server() {
+  "Xvfb" "$DPY" -screen 0 "${1}x${2}x24" -nolisten tcp -noreset >"$tmp/xvfb.log" 2>&1 &
+  xvfb=$!
+  i=0
+  until xdpyinfo -display "$DPY" >/dev/null 2>&1; do
+    i=$((i + 1))
+    if [ "$i" -gt 100 ] || ! kill -0 "$xvfb" 2>/dev/null; then
+      echo "bench: Xvfb did not start" >&2
+      cat "$tmp/xvfb.log" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+stop_server() {
+  kill "$xvfb"
+  wait "$xvfb" 2>/dev/null || true
+  xvfb=
+}
+
+# heads w h cols: one RandR monitor per grid cell, the first one taking over
+# the output so the server's automatic monitor goes away
+set_monitors() {
+  n=0
+  while [ "$n" -lt "$1" ]; do
+    x=$(((n % $4) * $2))
+    y=$((n / $4 * $3))
+    out=none
+    [ "$n" -eq 0 ] && out=screen
+    xrandr --display "$DPY" --setmonitor "bench$n" "$2/$2x$3/$3+$x+$y" "$out"
+    n=$((n + 1))
+  done
+}
+
+mkdir -p "$REF"
+status=0
+{
+  echo "# rootclock bench $(git describe --always --dirty 2>/dev/null || echo unknown)" \
+    "frames=$FRAMES $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+} | tee "$OUT"
+
+for layout in $LAYOUTS; do
+  heads=${layout%%x*}
+  size=${layout#*x}
+  w=${size%x*}
+  h=${size#*x}
+  cols=1
+  while [ $((cols * cols)) -lt "$heads" ]; do
+    cols=$((cols + 1))
+  done
+  rows=$(((heads + cols - 1) / cols))
+
+  start_server $((cols * w)) $((rows * h))
+  set_monitors "$heads" "$w" "$h" "$cols"
+
+  for mode in $MODES; do
+    before=$(server_ticks)
+    line=$(DISPLAY=$DPY TZ=UTC "$ROOTCLOCK" -b "$FRAMES" -m "$mode")
+    after=$(server_ticks)
+    cpu=$(awk -v t=$((after - before)) -v hz="$hz" -v f="$FRAMES" \
+      'BEGIN { printf "%.3f", t * 1000 / hz / f }')
+
+    name="$layout-$mode"
+    xwd -root -silent -display "$DPY" >"$tmp/$name.xwd"
+    if [ "$record" -eq 1 ]; then
+      cp "$tmp/$name.xwd" "$REF/$name.xwd"
+      ref=recorded
+    elif [ ! -f "$REF/$name.xwd" ]; then
+      ref=missing
+    elif cmp -s "$tmp/$name.xwd" "$REF/$name.xwd"; then
+      ref=ok
+    else
+      cp "$tmp/$name.xwd" "$REF/$name.actual.xwd"
+      ref=DIFF
+      status=1
+    fi
+    echo "layout=$layout $line server_cpu_ms=$cpu ref=$ref" | tee -a "$OUT"
+  done
+
+  stop_server
+done
+
+exit "$status"
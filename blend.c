@@ -0,0 +1,277 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_X86
+#include <immintrin.h>
+#endif
+
+#include "blend.h"
+
+/* x / 255 rounded, exact for x in [0, 255 * 255] */
+static inline unsigned int div255(unsigned int x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static inline unsigned int blend_channel(int op, unsigned int s, unsigned int d) {
+  switch (op) {
+  case BlendDifference:
+    return s > d ? s - d : d - s;
+  case BlendMultiply:
+    return div255(s * d);
+  case BlendScreen:
+    return s + d - div255(s * d);
+  case BlendOverlay:
+    return d < 128 ? div255(2 * s * d) : 255 - div255(2 * (255 - s) * (255 - d));
+  case BlendDarken:
+    return s < d ? s : d;
+  case BlendLighten:
+  default:
+    return s > d ? s : d;
+  }
+}
+
+static inline uint32_t lerp_pixel(uint32_t a, uint32_t b, unsigned int c) {
+  uint32_t out = a & 0xff000000u;
+  for (int sh = 0; sh < 24; sh += 8) {
+    unsigned int x = (a >> sh) & 0xff, y = (b >> sh) & 0xff;
+    out |= (uint32_t)div255(x * (255 - c) + y * c) << sh;
+  }
+  return out;
+}
+
+static void tile_scalar(int op, uint32_t *dst, const uint32_t *src, uint32_t fg,
+                        unsigned int alpha, size_t i, size_t n) {
+  for (; i < n; i++) {
+    uint32_t p = src[i], b = 0;
+    for (int sh = 0; sh < 24; sh += 8)
+      b |= (uint32_t)blend_channel(op, (fg >> sh) & 0xff, (p >> sh) & 0xff) << sh;
+    dst[i] = lerp_pixel(p, b, alpha);
+  }
+}
+
+static void lerp_scalar(uint32_t *dst, const uint32_t *a, const uint32_t *b, const uint8_t *cov,
+                        size_t i, size_t n) {
+  for (; i < n; i++)
+    dst[i] = cov[i] == 0 ? a[i] : cov[i] == 255 ? b[i] : lerp_pixel(a[i], b[i], cov[i]);
+}
+
+#ifdef BLEND_X86
+/* The vector kernels widen pixels to 16-bit channels, where every step of the
+ * scalar formulas fits without overflow, so all paths give identical pixels.
+ * Channel values stay within 0..255, which keeps the signed 16-bit min, max
+ * and compare instructions exact. */
+
+__attribute__((target("sse2"))) static inline __m128i div255_sse2(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static inline __m128i op_sse2(int op, __m128i s, __m128i d) {
+  const __m128i c255 = _mm_set1_epi16(255);
+  switch (op) {
+  case BlendDifference:
+    return _mm_sub_epi16(_mm_max_epi16(s, d), _mm_min_epi16(s, d));
+  case BlendMultiply:
+    return div255_sse2(_mm_mullo_epi16(s, d));
+  case BlendScreen:
+    return _mm_sub_epi16(_mm_add_epi16(s, d), div255_sse2(_mm_mullo_epi16(s, d)));
+  case BlendOverlay: {
+    __m128i lo = div255_sse2(_mm_slli_epi16(_mm_mullo_epi16(s, d), 1));
+    __m128i inv = _mm_mullo_epi16(_mm_sub_epi16(c255, s), _mm_sub_epi16(c255, d));
+    __m128i hi = _mm_sub_epi16(c255, div255_sse2(_mm_slli_epi16(inv, 1)));
+    __m128i dark = _mm_cmplt_epi16(d, _mm_set1_epi16(128));
+    return _mm_or_si128(_mm_and_si128(dark, lo), _mm_andnot_si128(dark, hi));
+  }
+  case BlendDarken:
+    return _mm_min_epi16(s, d);
+  case BlendLighten:
+  default:
+    return _mm_max_epi16(s, d);
+  }
+}
+
+/* div255(x * (255 - c) + y * c) per 16-bit channel */
+__attribute__((target("sse2"))) static inline __m128i mix_sse2(__m128i x, __m128i y, __m128i c) {
+  __m128i ic = _mm_sub_epi16(_mm_set1_epi16(255), c);
+  return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(x, ic), _mm_mullo_epi16(y, c)));
+}
+
+/* Takes the colour channels from out and the top byte from src */
+__attribute__((target("sse2"))) static inline __m128i keep_top_sse2(__m128i out, __m128i src) {
+  const __m128i top = _mm_set1_epi32((int)0xff000000u);
+  return _mm_or_si128(_mm_andnot_si128(top, out), _mm_and_si128(top, src));
+}
+
+__attribute__((target("sse2"))) static void tile_sse2(int op, uint32_t *dst, const uint32_t *src,
+                                                      uint32_t fg, unsigned int alpha, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32((int)fg), zero);
+  const __m128i a = _mm_set1_epi16((short)alpha);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_unpacklo_epi8(p, zero), hi = _mm_unpackhi_epi8(p, zero);
+    lo = mix_sse2(lo, op_sse2(op, s, lo), a);
+    hi = mix_sse2(hi, op_sse2(op, s, hi), a);
+    _mm_storeu_si128((__m128i *)(dst + i), keep_top_sse2(_mm_packus_epi16(lo, hi), p));
+  }
+  tile_scalar(op, dst, src, fg, alpha, i, n);
+}
+
+__attribute__((target("sse2"))) static void lerp_sse2(uint32_t *dst, const uint32_t *a,
+                                                      const uint32_t *b, const uint8_t *cov,
+                                                      size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32_t c4;
+    __builtin_memcpy(&c4, cov + i, 4);
+    if (c4 == 0 || c4 == 0xffffffffu) {
+      /* runs outside or fully inside the glyphs are plain copies */
+      _mm_storeu_si128((__m128i *)(dst + i),
+                       _mm_loadu_si128((const __m128i *)(c4 ? b + i : a + i)));
+      continue;
+    }
+    __m128i pa = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i pb = _mm_loadu_si128((const __m128i *)(b + i));
+    /* coverage byte of each pixel repeated in all four of its channels */
+    __m128i c = _mm_cvtsi32_si128((int)c4);
+    c = _mm_unpacklo_epi8(c, c);
+    c = _mm_unpacklo_epi16(c, c);
+    __m128i lo = mix_sse2(_mm_unpacklo_epi8(pa, zero), _mm_unpacklo_epi8(pb, zero),
+                          _mm_unpacklo_epi8(c, zero));
+    __m128i hi = mix_sse2(_mm_unpackhi_epi8(pa, zero), _mm_unpackhi_epi8(pb, zero),
+                          _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128((__m128i *)(dst + i), keep_top_sse2(_mm_packus_epi16(lo, hi), pa));
+  }
+  lerp_scalar(dst, a, b, cov, i, n);
+}
+
+__attribute__((target("avx2"))) static inline __m256i div255_avx2(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static inline __m256i op_avx2(int op, __m256i s, __m256i d) {
+  const __m256i c255 = _mm256_set1_epi16(255);
+  switch (op) {
+  case BlendDifference:
+    return _mm256_sub_epi16(_mm256_max_epi16(s, d), _mm256_min_epi16(s, d));
+  case BlendMultiply:
+    return div255_avx2(_mm256_mullo_epi16(s, d));
+  case BlendScreen:
+    return _mm256_sub_epi16(_mm256_add_epi16(s, d), div255_avx2(_mm256_mullo_epi16(s, d)));
+  case BlendOverlay: {
+    __m256i lo = div255_avx2(_mm256_slli_epi16(_mm256_mullo_epi16(s, d), 1));
+    __m256i inv = _mm256_mullo_epi16(_mm256_sub_epi16(c255, s), _mm256_sub_epi16(c255, d));
+    __m256i hi = _mm256_sub_epi16(c255, div255_avx2(_mm256_slli_epi16(inv, 1)));
+    __m256i dark = _mm256_cmpgt_epi16(_mm256_set1_epi16(128), d);
+    return _mm256_blendv_epi8(hi, lo, dark);
+  }
+  case BlendDarken:
+    return _mm256_min_epi16(s, d);
+  case BlendLighten:
+  default:
+    return _mm256_max_epi16(s, d);
+  }
+}
+
+__attribute__((target("avx2"))) static inline __m256i mix_avx2(__m256i x, __m256i y, __m256i c) {
+  __m256i ic = _mm256_sub_epi16(_mm256_set1_epi16(255), c);
+  return div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(x, ic), _mm256_mullo_epi16(y, c)));
+}
+
+__attribute__((target("avx2"))) static inline __m256i keep_top_avx2(__m256i out, __m256i src) {
+  const __m256i top = _mm256_set1_epi32((int)0xff000000u);
+  return _mm256_or_si256(_mm256_andnot_si256(top, out), _mm256_and_si256(top, src));
+}
+
+__attribute__((target("avx2"))) static void tile_avx2(int op, uint32_t *dst, const uint32_t *src,
+                                                      uint32_t fg, unsigned int alpha, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i s = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)fg), zero);
+  const __m256i a = _mm256_set1_epi16((short)alpha);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i lo = _mm256_unpacklo_epi8(p, zero), hi = _mm256_unpackhi_epi8(p, zero);
+    lo = mix_avx2(lo, op_avx2(op, s, lo), a);
+    hi = mix_avx2(hi, op_avx2(op, s, hi), a);
+    _mm256_storeu_si256((__m256i *)(dst + i), keep_top_avx2(_mm256_packus_epi16(lo, hi), p));
+  }
+  tile_sse2(op, dst + i, src + i, fg, alpha, n - i);
+}
+
+__attribute__((target("avx2"))) static void lerp_avx2(uint32_t *dst, const uint32_t *a,
+                                                      const uint32_t *b, const uint8_t *cov,
+                                                      size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i splat = _mm256_set1_epi32(0x01010101);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t c8;
+    __builtin_memcpy(&c8, cov + i, 8);
+    if (c8 == 0 || c8 == UINT64_MAX) {
+      _mm256_storeu_si256((__m256i *)(dst + i),
+                          _mm256_loadu_si256((const __m256i *)(c8 ? b + i : a + i)));
+      continue;
+    }
+    __m256i pa = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i pb = _mm256_loadu_si256((const __m256i *)(b + i));
+    /* one coverage per 32-bit lane, repeated into each of its bytes */
+    __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(cov + i)));
+    c = _mm256_mullo_epi32(c, splat);
+    __m256i lo = mix_avx2(_mm256_unpacklo_epi8(pa, zero), _mm256_unpacklo_epi8(pb, zero),
+                          _mm256_unpacklo_epi8(c, zero));
+    __m256i hi = mix_avx2(_mm256_unpackhi_epi8(pa, zero), _mm256_unpackhi_epi8(pb, zero),
+                          _mm256_unpackhi_epi8(c, zero));
+    _mm256_storeu_si256((__m256i *)(dst + i), keep_top_avx2(_mm256_packus_epi16(lo, hi), pa));
+  }
+  lerp_sse2(dst + i, a + i, b + i, cov + i, n - i);
+}
+#endif
+
+static void tile_generic(int op, uint32_t *dst, const uint32_t *src, uint32_t fg,
+                         unsigned int alpha, size_t n) {
+  tile_scalar(op, dst, src, fg, alpha, 0, n);
+}
+
+static void lerp_generic(uint32_t *dst, const uint32_t *a, const uint32_t *b, const uint8_t *cov,
+                         size_t n) {
+  lerp_scalar(dst, a, b, cov, 0, n);
+}
+
+static void (*tile_fn)(int, uint32_t *, const uint32_t *, uint32_t, unsigned int,
+                       size_t) = tile_generic;
+static void (*lerp_fn)(uint32_t *, const uint32_t *, const uint32_t *, const uint8_t *,
+                       size_t) = lerp_generic;
+
+const char *blend_init(void) {
+#ifdef BLEND_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    tile_fn = tile_avx2;
+    lerp_fn = lerp_avx2;
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    tile_fn = tile_sse2;
+    lerp_fn = lerp_sse2;
+    return "sse2";
+  }
+#endif
+  return "scalar";
+}
+
+void blend_tile(int op, uint32_t *dst, const uint32_t *src, uint32_t fg, unsigned int alpha,
+                size_t n) {
+  tile_fn(op, dst, src, fg, alpha, n);
+}
+
+void blend_lerp(uint32_t *dst, const uint32_t *a, const uint32_t *b, const uint8_t *cov,
+                size_t n) {
+  lerp_fn(dst, a, b, cov, n);
+}
@@ -0,0 +1,18 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Client-side versions of the RENDER PDF blend ops, on 32-bit xRGB pixels.
+ * The top byte of every pixel is passed through untouched. */
+enum { BlendDifference, BlendMultiply, BlendScreen, BlendOverlay, BlendDarken, BlendLighten };
+
+/* Picks the widest kernels the CPU supports and returns their name */
+const char *blend_init(void);
+
+/* dst = src blended with the colour fg (0xRRGGBB) at alpha, as if fully
+ * covered by the text: computed once per wallpaper and colour */
+void blend_tile(int op, uint32_t *dst, const uint32_t *src, uint32_t fg, unsigned int alpha,
+                size_t n);
+
+/* dst = a + (b - a) * cov / 255: the per-tick step between the wallpaper and
+ * its blended tile; dst may alias a or b */
+void blend_lerp(uint32_t *dst, const uint32_t *a, const uint32_t *b, const uint8_t *cov,
+                size_t n);
@@ -0,0 +1,87 @@
+/* Appearance */
+static const char *bg_color = "#000000";
+
+/* Background handling */
+enum background_mode_cfg {
+  BG_MODE_SOLID,
+  BG_MODE_COPY,
+  BG_MODE_INVERT,
+  BG_MODE_MULTIPLY,
+  BG_MODE_SCREEN,
+  BG_MODE_OVERLAY,
+  BG_MODE_DARKEN,
+  BG_MODE_LIGHTEN,
+};
+static const int background_mode = BG_MODE_SOLID;
+static const int block_padding_x = 48;
+static const int block_padding_y = 24;
+
+/* Time (1st line) */
+static const char *time_fonts[] = {
+    "Inter:style=ExtraBold:size=120", "Liberation Sans:style=Bold:size=120",
+    "Noto Sans Math:style=Regular:size=120", /* fallback for ratio symbol */
+};
+static const char *time_color = "#ffffff";
+static const char *time_fmt = "%-H\xe2\x88\xb6%M";
+
+/* Date (2nd line; set show_date=0 to disable) */
+static const int show_date = 1;
+static const char *date_fonts[] = {
+    "Inter:style=Regular:size=26",
+    "Liberation Sans:style=Regular:size=26",
+    "Noto Sans:style=Regular:size=26",
+};
+static const char *date_color = "#333333";
+static const char *date_fmt = "%A, %-d %B %Y";
+
+/* Rendering */
+static const int use_glyph_atlas = 1; /* pre-upload every glyph the formats can produce */
+static const int use_font_cache = 1;  /* keep resolved fonts in $XDG_CACHE_HOME/rootclock */
+static const int use_line_layers = 1; /* keep each drawn line on the server for reuse */
+
+/* Where the blend background modes are computed: AUTO probes the server at
+ * startup and blends on the client over MIT-SHM when RENDER lacks the blend
+ * ops or is slower; RENDER and SHM force one */
+enum blend_backend_cfg { BLEND_BACKEND_AUTO, BLEND_BACKEND_RENDER, BLEND_BACKEND_SHM };
+static const int blend_backend = BLEND_BACKEND_AUTO;
+
+/* Back buffer: BUFFER_SCREEN keeps one pixmap the size of the X screen,
+ * BUFFER_BLOCK one per monitor sized to its clock block, so server memory
+ * follows the text size rather than the screen size */
+enum buffer_mode_cfg { BUFFER_SCREEN, BUFFER_BLOCK };
+static const int buffer_mode = BUFFER_SCREEN;
+
+/* Install the rendered frame as the root window's background, so the server
+ * repaints desktop areas uncovered by moving windows without waking
+ * rootclock (not while a compositor is active). publish_root_pixmap also
+ * announces it in _XROOTPMAP_ID for pseudo-transparent clients; the
+ * wallpaper is restored on exit */
+static const int root_background = 0;
+static const int publish_root_pixmap = 0;
+
+/* With a compositor: DESKTOP_SCREEN maps one window over the whole screen,
+ * DESKTOP_BLOCK one 32-bit ARGB window per monitor sized to its clock block,
+ * so a tick damages only the glyphs that changed. The compositor shows its
+ * own wallpaper around them, so bg_color is not drawn. */
+enum desktop_mode_cfg { DESKTOP_SCREEN, DESKTOP_BLOCK };
+static const int desktop_mode = DESKTOP_SCREEN;
+
+/* Render the next tick this many ms early and only copy it to the screen on
+ * the boundary (0: render when the boundary is reached) */
+static const int prerender_ms = 50;
+
+/* Monitor hotplug: wait until RandR events have been quiet this long, then
+ * relayout once */
+static const int monitor_debounce_ms = 250;
+
+/* Refresh interval in seconds; 0 wakes only when time_fmt/date_fmt can change */
+static const int refresh_sec = 0;
+
+/* X request accounting, written as a Prometheus textfile (e.g. for the
+ * node_exporter textfile collector); NULL disables */
+static const char *stats_file = NULL;
+static const int stats_interval_sec = 60;
+
+/* Vertical layout */
+static const int block_y_off = 0;   /* shift entire block (time+date) in px */
+static const int line_spacing = 12; /* gap between time and date in px */
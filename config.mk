@@ -11,4 +11,4 @@ CPPFLAGS=
 CFLAGS  = -std=c99 -O2 -Wall -Wextra -Wpedantic $(CPPFLAGS) -D_DEFAULT_SOURCE
 LDFLAGS =
 INCS    = -I. -I/usr/include -I$(X11INC) -I/usr/include/freetype2
-LIBS    = -L/usr/lib -L$(X11LIB) -lX11 -lXft -lXinerama -lfontconfig -lXrender -lfreetype
+LIBS    = -L/usr/lib -L$(X11LIB) -lX11 -lX11-xcb -lxcb -lXft -lXinerama -lXext -lXdamage -lXfixes -lXrandr -lfontconfig -lXrender -lfreetype
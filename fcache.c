@@ -0,0 +1,297 @@
+/* See LICENSE file for copyright and license details. */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <fontconfig/fontconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fcache.h"
+
+/* Bump whenever the layout below changes; older files are then ignored and
+ * rewritten. All fields are native-endian: the file never leaves the host. */
+#define FCACHE_VERSION 1
+#define FCACHE_NAME "rootclock/fonts-v1.bin"
+#define FCACHE_MAX_SIZE (4u << 20)
+
+typedef struct {
+  char magic[4];
+  unsigned int version;
+  unsigned long long key;
+  unsigned int nsets;
+  unsigned int size;
+} FcacheHeader;
+
+static void *map;
+static size_t map_size;
+
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Hashes path and, if it exists, its modification time */
+static unsigned long long hash_mtime(unsigned long long h, const char *path) {
+  struct stat st;
+
+  h = fnv1a(h, path, strlen(path) + 1);
+  if (stat(path, &st) == 0) {
+    h = fnv1a(h, &st.st_mtim.tv_sec, sizeof st.st_mtim.tv_sec);
+    h = fnv1a(h, &st.st_mtim.tv_nsec, sizeof st.st_mtim.tv_nsec);
+  }
+  return h;
+}
+
+static unsigned long long hash_mtimes(unsigned long long h, FcStrList *paths) {
+  FcChar8 *path;
+
+  if (!paths)
+    return h;
+  while ((path = FcStrListNext(paths)))
+    h = hash_mtime(h, (const char *)path);
+  FcStrListDone(paths);
+  return h;
+}
+
+/* The configuration files fontconfig loaded and the directories holding
+ * them, so that adding a file to conf.d counts too, plus the user's own
+ * configuration, which may not have existed at the last start */
+static unsigned long long hash_config(unsigned long long h) {
+  FcStrList *files = FcConfigGetConfigFiles(NULL);
+  const char *xdg = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+  char dir[4096] = "", prev[4096] = "";
+  FcChar8 *file;
+
+  if (files) {
+    while ((file = FcStrListNext(files))) {
+      h = hash_mtime(h, (const char *)file);
+      const char *slash = strrchr((const char *)file, '/');
+      size_t len = slash ? (size_t)(slash - (const char *)file) : 0;
+      if (len == 0 || len >= sizeof dir)
+        continue;
+      memcpy(dir, file, len);
+      dir[len] = '\0';
+      if (strcmp(dir, prev) != 0) {
+        h = hash_mtime(h, dir);
+        memcpy(prev, dir, len + 1);
+      }
+    }
+    FcStrListDone(files);
+  }
+  int n = -1;
+  if (xdg && xdg[0] == '/')
+    n = snprintf(dir, sizeof dir, "%s/fontconfig", xdg);
+  else if (home && *home)
+    n = snprintf(dir, sizeof dir, "%s/.config/fontconfig", home);
+  if (n > 0 && (size_t)n + sizeof "/fonts.conf" <= sizeof dir) {
+    h = hash_mtime(h, dir);
+    strcat(dir, "/fonts.conf");
+    h = hash_mtime(h, dir);
+  }
+  return h;
+}
+
+/* Hashes the caller's configuration strings together with the modification
+ * times of fontconfig's configuration files and its font and cache
+ * directories: editing an alias, installing fonts or running fc-cache
+ * changes the key and so invalidates the file. */
+unsigned long long fcache_key(const char *const *parts, int n) {
+  unsigned long long h = 14695981039346656037ULL;
+  unsigned int version = FCACHE_VERSION;
+
+  h = fnv1a(h, &version, sizeof version);
+  for (int i = 0; i < n; i++) {
+    const char *s = parts[i] ? parts[i] : "";
+    h = fnv1a(h, s, strlen(s) + 1);
+  }
+  h = hash_config(h);
+  h = hash_mtimes(h, FcConfigGetFontDirs(NULL));
+  h = hash_mtimes(h, FcConfigGetCacheDirs(NULL));
+  return h;
+}
+
+static int cache_path(char *buf, size_t size, int mkdirs) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+
+  if (xdg && xdg[0] == '/')
+    n = snprintf(buf, size, "%s/%s", xdg, FCACHE_NAME);
+  else if (home && *home)
+    n = snprintf(buf, size, "%s/.cache/%s", home, FCACHE_NAME);
+  else
+    return -1;
+  if (n < 0 || (size_t)n >= size)
+    return -1;
+  if (mkdirs) {
+    /* create the parents of the file, ignoring the ones that exist */
+    for (char *p = buf + 1; *p; p++) {
+      if (*p != '/')
+        continue;
+      *p = '\0';
+      int err = mkdir(buf, 0700);
+      *p = '/';
+      if (err != 0 && errno != EEXIST)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Read cursor over the mapped file; every access is bounds checked so a
+ * truncated or foreign file is rejected instead of trusted. */
+typedef struct {
+  const char *p, *end;
+} Cursor;
+
+static const void *take(Cursor *c, size_t len) {
+  const char *p = c->p;
+  if (len > (size_t)(c->end - c->p))
+    return NULL;
+  c->p += (len + 3) & ~(size_t)3;
+  if (c->p > c->end)
+    c->p = c->end;
+  return p;
+}
+
+static const char *take_string(Cursor *c, unsigned int len) {
+  const char *s = take(c, (size_t)len + 1);
+  return s && s[len] == '\0' && strlen(s) == len ? s : NULL;
+}
+
+static int parse_set(Cursor *c, FcacheSet *set) {
+  const unsigned int *counts = take(c, 2 * sizeof *counts);
+
+  if (!counts || counts[0] > FCACHE_MAX_FONTS || counts[0] == 0)
+    return 0;
+  set->nfonts = counts[0];
+  set->nglyphs = counts[1];
+  for (unsigned int i = 0; i < set->nfonts; i++) {
+    const unsigned int *lens = take(c, 2 * sizeof *lens);
+    if (!lens || !(set->fonts[i].resolved = take_string(c, lens[0])) ||
+        !(set->fonts[i].pattern = take_string(c, lens[1])))
+      return 0;
+  }
+  if (set->nglyphs > (size_t)(c->end - c->p) / sizeof *set->glyphs)
+    return 0;
+  set->glyphs = take(c, set->nglyphs * sizeof *set->glyphs);
+  for (unsigned int i = 0; i < set->nglyphs; i++) {
+    if (set->glyphs[i].font < -1 || set->glyphs[i].font >= (int)set->nfonts)
+      return 0;
+  }
+  return 1;
+}
+
+/* Maps the cache file and points sets into it. Returns 1 when the file
+ * matches key and holds nsets fontsets; the strings and glyph tables stay
+ * valid until fcache_release(). */
+int fcache_load(unsigned long long key, FcacheSet *sets, int nsets) {
+  char path[4096];
+  struct stat st;
+  const FcacheHeader *hdr;
+  Cursor c;
+  int fd;
+
+  memset(sets, 0, (size_t)nsets * sizeof *sets);
+  fcache_release();
+  if (cache_path(path, sizeof path, 0) != 0 || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof *hdr || st.st_size > FCACHE_MAX_SIZE) {
+    close(fd);
+    return 0;
+  }
+  map_size = (size_t)st.st_size;
+  map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    return 0;
+  }
+
+  hdr = map;
+  if (memcmp(hdr->magic, "RCFC", 4) != 0 || hdr->version != FCACHE_VERSION || hdr->key != key ||
+      hdr->nsets != (unsigned int)nsets || hdr->size != map_size)
+    goto bad;
+  c.p = (const char *)map + sizeof *hdr;
+  c.end = (const char *)map + map_size;
+  for (int i = 0; i < nsets; i++) {
+    if (!parse_set(&c, &sets[i]))
+      goto bad;
+  }
+  return 1;
+
+bad:
+  memset(sets, 0, (size_t)nsets * sizeof *sets);
+  fcache_release();
+  return 0;
+}
+
+void fcache_release(void) {
+  if (map)
+    munmap(map, map_size);
+  map = NULL;
+  map_size = 0;
+}
+
+static void put(FILE *f, const void *data, size_t len) {
+  static const char zero[4];
+  fwrite(data, 1, len, f);
+  fwrite(zero, 1, ((len + 3) & ~(size_t)3) - len, f);
+}
+
+static void put_string(FILE *f, const char *s) { put(f, s, strlen(s) + 1); }
+
+/* Writes sets under key, replacing the file atomically so a concurrent
+ * start never maps a partial write */
+int fcache_store(unsigned long long key, const FcacheSet *sets, int nsets) {
+  char path[4096], tmp[4096 + 32];
+  FcacheHeader hdr = {{'R', 'C', 'F', 'C'}, FCACHE_VERSION, key, (unsigned int)nsets, 0};
+  FILE *f;
+  long size;
+
+  if (cache_path(path, sizeof path, 1) != 0)
+    return -1;
+  snprintf(tmp, sizeof tmp, "%s.%ld.tmp", path, (long)getpid());
+  if (!(f = fopen(tmp, "wb")))
+    return -1;
+  put(f, &hdr, sizeof hdr);
+  for (int i = 0; i < nsets; i++) {
+    unsigned int counts[2] = {sets[i].nfonts, sets[i].nglyphs};
+    put(f, counts, sizeof counts);
+    for (unsigned int j = 0; j < sets[i].nfonts; j++) {
+      unsigned int lens[2] = {(unsigned int)strlen(sets[i].fonts[j].resolved),
+                              (unsigned int)strlen(sets[i].fonts[j].pattern)};
+      put(f, lens, sizeof lens);
+      put_string(f, sets[i].fonts[j].resolved);
+      put_string(f, sets[i].fonts[j].pattern);
+    }
+    put(f, sets[i].glyphs, sets[i].nglyphs * sizeof *sets[i].glyphs);
+  }
+  /* the total size goes into the header last so truncation is detected */
+  if ((size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+    goto fail;
+  hdr.size = (unsigned int)size;
+  put(f, &hdr, sizeof hdr);
+  if (ferror(f) || fclose(f) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  if (rename(tmp, path) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+
+fail:
+  fclose(f);
+  remove(tmp);
+  return -1;
+}
@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Persistent font resolution cache: what a cold start learned about the
+ * configured fontsets (the matched font of every name and fallback, which
+ * font covers each codepoint the formats can produce, and its advance),
+ * stored under $XDG_CACHE_HOME so later starts skip fontconfig matching. */
+#define FCACHE_MAX_FONTS 32
+
+typedef struct {
+  int cp;
+  int font; /* index into FcacheSet.fonts, -1 when no font covers cp */
+  unsigned int adv;
+} FcacheGlyph;
+
+typedef struct {
+  const char *resolved; /* FcNameUnparse() of the matched pattern */
+  const char *pattern;  /* the configured name as a pattern, "" for fallbacks */
+} FcacheFont;
+
+typedef struct {
+  FcacheFont fonts[FCACHE_MAX_FONTS];
+  unsigned int nfonts;
+  const FcacheGlyph *glyphs;
+  unsigned int nglyphs;
+} FcacheSet;
+
+unsigned long long fcache_key(const char *const *parts, int n);
+int fcache_load(unsigned long long key, FcacheSet *sets, int nsets);
+void fcache_release(void);
+int fcache_store(unsigned long long key, const FcacheSet *sets, int nsets);
@@ -26,14 +26,24 @@
             pkgs.gnumake
             pkgs.pkg-config
             pkgs.clang-tools
+            # make bench
+            pkgs.xorg.xorgserver
+            pkgs.xorg.xrandr
+            pkgs.xorg.xwd
+            pkgs.xorg.xdpyinfo
           ];
           buildInputs = [
             pkgs.fontconfig
             pkgs.freetype
             pkgs.xorg.libX11
             pkgs.xorg.libXft
+            pkgs.xorg.libXdamage
+            pkgs.xorg.libXext
+            pkgs.xorg.libXfixes
             pkgs.xorg.libXinerama
+            pkgs.xorg.libXrandr
             pkgs.xorg.libXrender
+            pkgs.xorg.libxcb
           ];
           shellHook = ''
             echo "rootclock dev shell: run 'make' to build, 'make clean' to clean, 'clang-format -i rootclock.c' to format."
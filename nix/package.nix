@@ -5,9 +5,14 @@
   fontconfig,
   freetype,
   libX11,
+  libXdamage,
+  libXext,
+  libXfixes,
   libXft,
   libXinerama,
+  libXrandr,
   libXrender,
+  libxcb,
   conf ? null,
 }:
 
@@ -25,9 +30,14 @@ stdenv.mkDerivation rec {
     fontconfig
     freetype
     libX11
+    libXdamage
+    libXext
+    libXfixes
     libXft
     libXinerama
+    libXrandr
     libXrender
+    libxcb
   ];
 
   postPatch = lib.optionalString (conf != null) ''
@@ -50,7 +60,7 @@ stdenv.mkDerivation rec {
     description = "Draw a configurable clock/date on the X root window";
     homepage = "https://github.com/kesor/rootclock";
     license = licenses.mit;
-    platforms = platforms.unix;
+    platforms = platforms.linux;
     maintainers = with maintainers; [ evgeny ];
   };
 }
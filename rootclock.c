@@ -2,22 +2,41 @@
 #define _POSIX_C_SOURCE 200809L
 #include <X11/Xatom.h>
 #include <X11/Xft/Xft.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/shape.h>
 #include <errno.h>
 #include <fontconfig/fontconfig.h>
+#include <limits.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 
+#include "blend.h"
 #include "config.h"
 #include "drw.h"
+#include "fcache.h"
+#include "stats.h"
+#include "timefmt.h"
 #include "util.h"
 
 #define UTF_INVALID 0xFFFD
@@ -31,20 +50,277 @@
 #define FALLBACK_DATE "Unknown Date"
 #define TIME_BUF_SIZE 64
 #define DATE_BUF_SIZE 128
-#define MIN_UPDATE_INTERVAL_MS 50 /* Minimum 50ms between forced updates */
+#define TICK_SECOND 1
+#define TICK_DAY 86400
+#define ATLAS_MAX_GLYPHS 512
+#define ADV_CACHE_SIZE 1024 /* codepoint slots per fontset, a power of two */
+#define ATLAS_MAX_LINE DATE_BUF_SIZE
+#define RCACHE_FILLS 8       /* solid-fill source pictures kept alive */
+#define RCACHE_MASK_ALIGN 64 /* coverage mask grows in steps of this many px */
+#define DIRTY_PAD_DIV 4 /* dirty spans grow by line height / DIRTY_PAD_DIV for overhang */
+#define BLOCK_BUF_ALIGN 64 /* block buffers grow in steps of this many px */
+#define BLEND_PROBE_W 512  /* area the startup probe blends, about one clock line */
+#define BLEND_PROBE_H 160
+#define BLEND_PROBE_RUNS 8
+#define BLEND_TILES 2 /* pre-blended tiles per block: one per line colour */
+#define BENCH_START 1704067200 /* 2024-01-01 00:00:00 UTC */
+#define BENCH_CELL 64          /* synthetic wallpaper checker size */
+#define CROP_HASH_ROWS 64      /* wallpaper rows read per request when hashing */
+#define OWN_FLUSHES 4          /* flushes whose root writes are remembered */
+#define BGCACHE_DIRTY 16       /* foreign damage rects kept before merging */
+
+static int running = 1;
+
+/* background_mode, overridable on the command line for benchmarking */
+static int bg_mode;
+static const char *const bg_mode_names[] = {
+    "solid", "copy", "invert", "multiply", "screen", "overlay", "darken", "lighten",
+};
 
-static volatile sig_atomic_t running = 1;
+/* Cached monitor geometry (RandR monitors, or Xinerama screens when RandR
+ * 1.5 is unavailable). A count of 0 means "the whole X screen". */
+typedef struct {
+  int x, y, w, h;
+} MonRect;
 
-/* Cached Xinerama monitor information */
-static XineramaScreenInfo *cached_monitors = NULL;
+static MonRect cached_monitors[MAX_MONITORS];
 static int cached_monitor_count = 0;
 static int monitors_dirty = 1; /* force initial query */
+static int randr_event_base = -1;
+static int randr_has_monitors = 0;
+
+/* Geometry of one monitor's clock block as last laid out */
+typedef struct {
+  int rx, ry, rw, rh;
+  int bx, by;
+  unsigned int bw, bh;
+  int tx, time_top;
+  unsigned int tw, time_h;
+  int has_date;
+  int dx, date_top;
+  unsigned int dw, date_h;
+} BlockLayout;
+
+/* What is currently on screen for a monitor, so the next frame only has to
+ * repaint the glyph cells that changed */
+typedef struct {
+  int valid;
+  Pixmap wallpaper;
+  BlockLayout layout;
+  char tstr[TIME_BUF_SIZE];
+  char dstr[DATE_BUF_SIZE];
+  XRectangle refresh; /* part of the block to repaint even if unchanged, empty if none */
+} MonState;
+
+static MonState mon_state[MAX_MONITORS];
+
+/* Monitors of the same size over identical wallpaper render identical
+ * blocks: only the first of each group is drawn, the others get copies of
+ * what it queued for presenting */
+typedef struct {
+  int leader;              /* monitor this one copies, or its own index */
+  unsigned int first, end; /* present_rects the leader queued this frame */
+  MonState prev;           /* the leader's state before this frame */
+  unsigned long long crop; /* hash of the wallpaper under the block, 0 if unknown */
+  int crop_valid;
+  unsigned long crop_gen; /* wallpaper_gen the hash was taken at */
+  XRectangle crop_rect;   /* block the hash covers */
+} MonGroup;
+
+static MonGroup mon_group[MAX_MONITORS];
+static XRectangle *draw_clip = NULL; /* restricts drawing into drw->drawable */
+
+/* A Picture wrapping a drawable, and whether a clip is set on it */
+typedef struct {
+  Drawable drawable;
+  Picture pic;
+  int clipped;
+} DstPicture;
+
+/* BUFFER_BLOCK mode: each monitor draws into a pixmap covering only its clock
+ * block, bound as drw->drawable while that monitor renders */
+typedef struct {
+  Pixmap pm;
+  unsigned int w, h;
+  int argb; /* pm is 32-bit, for the monitor's ARGB window */
+  DstPicture dst;
+} BlockBuf;
+
+static BlockBuf block_bufs[MAX_MONITORS];
+static BlockBuf *draw_buf = NULL; /* bound block buffer, if any */
+static int draw_org_x, draw_org_y; /* root position of drw->drawable's 0,0 */
+static Window draw_dst = None;     /* ARGB window the bound buffer is presented to */
+static GC draw_gc_prev;            /* drw->gc while an ARGB buffer is bound */
+
+/* DESKTOP_BLOCK with a compositor: one 32-bit ARGB window per monitor,
+ * covering only its clock block and transparent around the glyphs */
+static struct {
+  int active;
+  int unavailable; /* the server has no ARGB visual */
+  Visual *visual;
+  Colormap cmap;
+  XRenderPictFormat *fmt;
+  GC gc; /* for 32-bit drawables */
+  Picture src; /* background source of the blend modes */
+  Drawable src_drawable;
+  unsigned long src_gen;
+  Window win[MAX_MONITORS];
+  XRectangle geom[MAX_MONITORS];
+} argb;
+
+/* A finished line (background and text) kept on the server, so a line whose
+ * text, fonts, colours and background did not change is copied back instead
+ * of being measured and rasterised again */
+typedef struct {
+  Pixmap pm;
+  unsigned int pw, ph; /* allocated size */
+  int valid;
+  int x, y; /* root position of the snapshot, compared only over a wallpaper */
+  unsigned int w, h;
+  Fnt *font;
+  Clr *scm;
+  Drawable bg;
+  unsigned long bg_gen;
+  int fill_bg;
+  char text[DATE_BUF_SIZE];
+} LineLayer;
+
+enum { LayerTime, LayerDate, LayerLast };
+static LineLayer line_layers[MAX_MONITORS][LayerLast];
+static LineLayer *draw_layers = NULL; /* layers of the monitor being drawn, if usable */
+static Drawable draw_bg = None;       /* background source of the monitor being drawn */
+static GC layer_gc = NULL;            /* unclipped, for snapshots */
+
+static void line_layers_free(Display *dpy, LineLayer *l) {
+  for (int i = 0; i < LayerLast; i++) {
+    if (l[i].pm != None)
+      XFreePixmap(dpy, l[i].pm);
+    memset(&l[i], 0, sizeof l[i]);
+  }
+}
+
+static void dst_picture_free(Display *dpy, DstPicture *d) {
+  if (d->pic != None)
+    XRenderFreePicture(dpy, d->pic);
+  memset(d, 0, sizeof *d);
+}
+
+static void block_buf_free(Display *dpy, BlockBuf *b) {
+  dst_picture_free(dpy, &b->dst);
+  if (b->pm != None)
+    XFreePixmap(dpy, b->pm);
+  memset(b, 0, sizeof *b);
+}
+
+/* Destroys the ARGB windows of monitors from and up */
+static void argb_destroy(Display *dpy, int from) {
+  for (int i = from; i < MAX_MONITORS; i++) {
+    if (argb.win[i] != None)
+      XDestroyWindow(dpy, argb.win[i]);
+    argb.win[i] = None;
+  }
+}
+
+/* A pending update of the target window: a copy from src, or a fill with
+ * pixel when src is None */
+typedef struct {
+  Drawable src;
+  Drawable dst; /* None: the window present_flush is given */
+  int sx, sy, dx, dy;
+  unsigned int w, h;
+  unsigned long pixel;
+} PresentRect;
+
+static PresentRect present_rects[MAX_MONITORS * 12]; /* rendered but not yet on screen */
+static unsigned int npresent = 0;
+static int present_merged = 0; /* rects had to be merged or dropped since the last flush */
+
+static int rect_contains(const XRectangle *a, const XRectangle *b) {
+  return b->x >= a->x && b->y >= a->y && b->x + b->width <= a->x + a->width &&
+         b->y + b->height <= a->y + a->height;
+}
+
+static int rect_intersects(const XRectangle *a, const XRectangle *b) {
+  return b->x < a->x + a->width && a->x < b->x + b->width && b->y < a->y + a->height &&
+         a->y < b->y + b->height;
+}
+
+/* What the last few flushes wrote to the root window, so the damage that
+ * causes is not taken for someone else's drawing */
+static XRectangle own_rects[OWN_FLUSHES][LENGTH(present_rects) + MAX_MONITORS];
+static unsigned int own_n[OWN_FLUSHES], own_gen;
+
+static void own_add(int x, int y, unsigned int w, unsigned int h) {
+  if (own_n[own_gen] == LENGTH(own_rects[0]))
+    return;
+  XRectangle *r = &own_rects[own_gen][own_n[own_gen]++];
+  r->x = (short)x;
+  r->y = (short)y;
+  r->width = (unsigned short)w;
+  r->height = (unsigned short)h;
+}
+
+/* Server-side region of everything own_rects holds */
+static XserverRegion own_region(Display *dpy) {
+  static XRectangle all[LENGTH(own_rects) * LENGTH(own_rects[0])];
+  unsigned int n = 0;
+
+  for (unsigned int g = 0; g < OWN_FLUSHES; g++) {
+    memcpy(&all[n], own_rects[g], own_n[g] * sizeof all[0]);
+    n += own_n[g];
+  }
+  return XFixesCreateRegion(dpy, all, (int)n);
+}
 
 /* Time tracking for consistent updates */
+static TimeFmt *time_prog, *date_prog; /* time_fmt and date_fmt, compiled */
 static time_t last_displayed_time = 0;
+static int tick_step = TICK_SECOND; /* seconds between possible changes of the output */
 static unsigned long invert_xor_mask = 0;
 static int warned_no_wallpaper_pixmap = 0;
 
+/* Every atom rootclock uses, interned in one round trip at startup */
+enum {
+  AtomXRootPmap,
+  AtomEsetroot,
+  AtomCmSel,
+  AtomWmType,
+  AtomWmTypeDesktop,
+  AtomWmState,
+  AtomWmStateBelow,
+  AtomLast
+};
+static Atom atoms[AtomLast];
+
+/* Round-trip queries go out as XCB cookies as soon as their answer may have
+ * changed and are collected only where it is needed, so the ones of one
+ * iteration share a single trip instead of queueing behind each other */
+static struct {
+  xcb_get_property_cookie_t pmap[2]; /* _XROOTPMAP_ID, ESETROOT_PMAP_ID */
+  int pmap_pending;
+  xcb_get_selection_owner_cookie_t owner;
+  int owner_pending;
+  int inflight; /* issued since the last wait for a reply */
+} query;
+
+/* Completion of the last submitted frame: a GetInputFocus sent behind it,
+ * whose reply means the server has executed everything before it */
+static struct {
+  xcb_get_input_focus_cookie_t cookie;
+  int pending;
+} fence;
+
+/* Wallpaper pixmap ID, refreshed only when the root properties change */
+static Pixmap wallpaper_cached = None;
+static int wallpaper_dirty = 1;
+static unsigned long wallpaper_gen; /* bumped whenever the wallpaper is re-read */
+
+/* root_background: frames are presented into this pixmap, which is the root
+ * window's background, so the server repaints exposed desktop on its own */
+static Pixmap root_bg = None;
+static unsigned int root_bg_w, root_bg_h;
+static int root_bg_stale; /* someone else set the root background since */
+
 static int utf8decode(const char *s_in, long *u, int *err) {
   static const unsigned char lens[] = {
       /* 0XXXX */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
@@ -86,71 +362,582 @@ static int utf8decode(const char *s_in, long *u, int *err) {
   return len;
 }
 
-static void signal_handler(int sig) {
-  (void)sig;
-  running = 0;
+/* Event sources multiplexed by the main loop */
+enum { LOOP_X, LOOP_TICK, LOOP_TOPOLOGY, LOOP_SIGNAL, LOOP_TZ };
+
+static int loop_add(int epfd, int fd, uint32_t tag) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  ev.data.u32 = tag;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Arms the tick timer for an absolute CLOCK_REALTIME instant. The kernel
+ * cancels it (read fails with ECANCELED) whenever the clock is set, so NTP
+ * steps and manual changes are noticed immediately. */
+static int tick_arm(int tfd, const struct timespec *at) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof its);
+  its.it_value = *at;
+  return timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+/* (Re)starts the monitor debounce window; every topology event pushes the
+ * relayout back so a dock/undock storm is applied only once. */
+static int topology_arm(int dfd) {
+  struct itimerspec its;
+  int ms = MAX(monitor_debounce_ms, 1);
+  memset(&its, 0, sizeof its);
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  return timerfd_settime(dfd, 0, &its, NULL);
+}
+
+/* Instant prerender_ms before the second at */
+static struct timespec prerender_deadline(time_t at) {
+  struct timespec ts;
+  long lead_ns = (long)MIN(MAX(prerender_ms, 0), 999) * 1000000L;
+  ts.tv_sec = at;
+  ts.tv_nsec = 0;
+  if (lead_ns > 0) {
+    ts.tv_sec--;
+    ts.tv_nsec = 1000000000L - lead_ns;
+  }
+  return ts;
+}
+
+static void mon_state_invalidate(void) { memset(mon_state, 0, sizeof mon_state); }
+
+/* Next local-time boundary after now that is a multiple of tick_step
+ * seconds since local midnight, or the next UTC offset change if that comes
+ * first. */
+static time_t sched_next(time_t now) {
+  if (tick_step <= 1)
+    return now + 1;
+  long long local = (long long)now + tz_offset(now);
+  long sod = (long)(((local % TICK_DAY) + TICK_DAY) % TICK_DAY);
+  return MIN(now + (tick_step - sod % tick_step), tz_next_change(now));
 }
 
-static void update_monitor_cache(Display *dpy) {
-  if (cached_monitors) {
-    XFree(cached_monitors);
-    cached_monitors = NULL;
-    cached_monitor_count = 0;
+/* Subscribes to RandR screen and CRTC changes. Returns 0 if the server
+ * has no RandR, in which case root ConfigureNotify is all we get. */
+static int randr_watch(Display *dpy, Window root) {
+  int error_base, major = 0, minor = 0;
+  if (!XRRQueryExtension(dpy, &randr_event_base, &error_base) ||
+      !XRRQueryVersion(dpy, &major, &minor)) {
+    randr_event_base = -1;
+    return 0;
   }
+  randr_has_monitors = major > 1 || (major == 1 && minor >= 5);
+  XRRSelectInput(dpy, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+  return 1;
+}
+
+static int is_topology_event(const XEvent *ev, Window root) {
+  if (ev->type == ConfigureNotify)
+    return ev->xconfigure.window == root;
+  return randr_event_base >= 0 && (ev->type == randr_event_base + RRScreenChangeNotify ||
+                                   ev->type == randr_event_base + RRNotify);
+}
+
+static void monitor_add(int x, int y, int w, int h) {
+  if (cached_monitor_count >= MAX_MONITORS)
+    return;
+  cached_monitors[cached_monitor_count].x = x;
+  cached_monitors[cached_monitor_count].y = y;
+  cached_monitors[cached_monitor_count].w = w;
+  cached_monitors[cached_monitor_count].h = h;
+  cached_monitor_count++;
+}
 
-  cached_monitor_count = 1; /* Default fallback */
-  if (XineramaIsActive(dpy)) {
+static void update_monitor_cache(Display *dpy, Window root) {
+  cached_monitor_count = 0;
+
+  if (randr_has_monitors) {
+    int n = 0;
+    XRRMonitorInfo *mi = XRRGetMonitors(dpy, root, True, &n);
+    stats_roundtrip();
+    if (mi && n > 0 && n <= MAX_MONITORS) {
+      for (int i = 0; i < n; i++)
+        monitor_add(mi[i].x, mi[i].y, mi[i].width, mi[i].height);
+    } else {
+      fprintf(stderr, "rootclock: RandR monitor query failed or returned invalid "
+                      "data, using single screen\n");
+    }
+    if (mi)
+      XRRFreeMonitors(mi);
+  } else if (XineramaIsActive(dpy)) {
     int n;
     XineramaScreenInfo *xi = XineramaQueryScreens(dpy, &n);
+    stats_roundtrip();
     if (xi && n > 0 && n <= MAX_MONITORS) {
-      cached_monitors = xi;
-      cached_monitor_count = n;
+      for (int i = 0; i < n; i++)
+        monitor_add(xi[i].x_org, xi[i].y_org, xi[i].width, xi[i].height);
     } else {
       fprintf(stderr, "rootclock: Xinerama query failed or returned invalid "
                       "data, using single screen\n");
-      if (xi) {
-        XFree(xi);
-      }
+    }
+    if (xi) {
+      XFree(xi);
     }
   }
+  for (int i = MAX(cached_monitor_count, 1); i < MAX_MONITORS; i++) {
+    block_buf_free(dpy, &block_bufs[i]);
+    line_layers_free(dpy, line_layers[i]);
+  }
+  argb_destroy(dpy, MAX(cached_monitor_count, 1));
   monitors_dirty = 0;
+  mon_state_invalidate();
+  memset(mon_group, 0, sizeof mon_group);
 }
 
-static Pixmap get_root_pixmap(Display *dpy, Window root) {
-  static Atom atom_xrootpmap = None;
-  static Atom atom_esetroot = None;
-  Atom type = None;
-  int format = 0;
-  unsigned long nitems = 0, bytes_after = 0;
-  unsigned char *data = NULL;
-  Pixmap pixmap = None;
-  Atom atoms[2];
+static void intern_atoms(Display *dpy, int screen) {
+  char cm_sel[32];
+  char *names[AtomLast] = {
+      [AtomXRootPmap] = "_XROOTPMAP_ID",
+      [AtomEsetroot] = "ESETROOT_PMAP_ID",
+      [AtomCmSel] = cm_sel,
+      [AtomWmType] = "_NET_WM_WINDOW_TYPE",
+      [AtomWmTypeDesktop] = "_NET_WM_WINDOW_TYPE_DESKTOP",
+      [AtomWmState] = "_NET_WM_STATE",
+      [AtomWmStateBelow] = "_NET_WM_STATE_BELOW",
+  };
+
+  snprintf(cm_sel, sizeof cm_sel, "_NET_WM_CM_S%d", screen);
+  if (!XInternAtoms(dpy, names, AtomLast, False, atoms))
+    die("rootclock: cannot intern atoms");
+  stats_roundtrip();
+}
+
+/* Counts the trip the first reply of a batch waits for; the rest of the
+ * batch arrived with it */
+static void query_wait(void) {
+  if (query.inflight) {
+    stats_roundtrip();
+    query.inflight = 0;
+  }
+}
 
-  if (atom_xrootpmap == None)
-    atom_xrootpmap = XInternAtom(dpy, "_XROOTPMAP_ID", False);
-  if (atom_esetroot == None)
-    atom_esetroot = XInternAtom(dpy, "ESETROOT_PMAP_ID", False);
+/* Asks for both wallpaper properties, dropping answers to an older ask that
+ * may predate the latest change */
+static void query_root_pixmap(Display *dpy, Window root) {
+  xcb_connection_t *c = XGetXCBConnection(dpy);
+  if (query.pmap_pending) {
+    for (int i = 0; i < 2; i++)
+      xcb_discard_reply(c, query.pmap[i].sequence);
+  }
+  for (int i = 0; i < 2; i++) {
+    query.pmap[i] = xcb_get_property(c, 0, (xcb_window_t)root,
+                                     (xcb_atom_t)atoms[i ? AtomEsetroot : AtomXRootPmap],
+                                     XCB_GET_PROPERTY_TYPE_ANY, 0, 1);
+    stats_xcb_request(query.pmap[i].sequence, sizeof(xcb_get_property_request_t));
+  }
+  query.pmap_pending = 1;
+  query.inflight = 1;
+}
 
-  atoms[0] = atom_xrootpmap;
-  atoms[1] = atom_esetroot;
+static Pixmap collect_root_pixmap(Display *dpy) {
+  xcb_connection_t *c = XGetXCBConnection(dpy);
+  Pixmap pixmap = None;
 
+  if (!query.pmap_pending)
+    return None;
+  query_wait();
+  query.pmap_pending = 0;
   for (int i = 0; i < 2; i++) {
-    if (atoms[i] == None)
+    xcb_generic_error_t *err = NULL;
+    xcb_get_property_reply_t *r = xcb_get_property_reply(c, query.pmap[i], &err);
+    free(err);
+    if (!r)
+      continue;
+    if (pixmap == None && r->type == XCB_ATOM_PIXMAP && r->format == 32 &&
+        xcb_get_property_value_length(r) == 4)
+      pixmap = *(uint32_t *)xcb_get_property_value(r);
+    free(r);
+  }
+  return pixmap;
+}
+
+static Pixmap get_root_pixmap(Display *dpy, Window root) {
+  if (!query.pmap_pending)
+    query_root_pixmap(dpy, root);
+  return collect_root_pixmap(dpy);
+}
+
+/* Marks the end of everything sent so far and flushes it, without waiting */
+static void fence_submit(Display *dpy) {
+  xcb_connection_t *c = XGetXCBConnection(dpy);
+  /* a newer fence implies the older one */
+  if (fence.pending)
+    xcb_discard_reply(c, fence.cookie.sequence);
+  fence.cookie = xcb_get_input_focus(c);
+  stats_xcb_request(fence.cookie.sequence, sizeof(xcb_get_input_focus_request_t));
+  fence.pending = 1;
+  xcb_flush(c);
+}
+
+/* Returns once the last fence has passed. By the next tick its reply has
+ * normally long arrived, so only a server that is still behind costs a
+ * round trip here. */
+static void fence_wait(Display *dpy) {
+  xcb_connection_t *c = XGetXCBConnection(dpy);
+  xcb_generic_error_t *err = NULL;
+  void *reply = NULL;
+
+  if (!fence.pending)
+    return;
+  fence.pending = 0;
+  if (!xcb_poll_for_reply(c, fence.cookie.sequence, &reply, &err)) {
+    stats_roundtrip();
+    reply = xcb_get_input_focus_reply(c, fence.cookie, &err);
+  }
+  free(reply);
+  free(err);
+}
+
+static void present_queue(Drawable src, Drawable dst, int sx, int sy, int dx, int dy, int w,
+                          int h, unsigned long pixel) {
+  if (w <= 0 || h <= 0)
+    return;
+  if (npresent == LENGTH(present_rects)) {
+    /* out of slots: grow the last one to cover the new rectangle too, which
+     * only works for copies from the same source at the same offset */
+    PresentRect *r = &present_rects[npresent - 1];
+    present_merged = 1;
+    if (r->src != src || r->dst != dst || r->pixel != pixel || r->dx - r->sx != dx - sx ||
+        r->dy - r->sy != dy - sy)
+      return;
+    int x1 = MAX(r->dx + (int)r->w, dx + w), y1 = MAX(r->dy + (int)r->h, dy + h);
+    r->dx = MIN(r->dx, dx);
+    r->dy = MIN(r->dy, dy);
+    r->sx = r->dx - (dx - sx);
+    r->sy = r->dy - (dy - sy);
+    r->w = (unsigned int)(x1 - r->dx);
+    r->h = (unsigned int)(y1 - r->dy);
+    return;
+  }
+  PresentRect *r = &present_rects[npresent++];
+  r->src = src;
+  r->dst = dst;
+  r->sx = sx;
+  r->sy = sy;
+  r->dx = dx;
+  r->dy = dy;
+  r->w = (unsigned int)w;
+  r->h = (unsigned int)h;
+  r->pixel = pixel;
+}
+
+/* Queues a rectangle of drw->drawable that differs from what is on screen.
+ * An ARGB window sits at the buffer's origin, so it takes buffer coordinates. */
+static void present_add(Drawable src, int x, int y, int w, int h) {
+  if (draw_buf && draw_buf->argb) {
+    if (draw_dst != None)
+      present_queue(src, draw_dst, x, y, x, y, w, h, 0);
+    return;
+  }
+  present_queue(src, None, x, y, x + draw_org_x, y + draw_org_y, w, h, 0);
+}
+
+/* Queues window background straight from src (root coordinates), or a fill
+ * with pixel when there is no source */
+static void present_background(Drawable src, unsigned long pixel, int x, int y, int w, int h) {
+  present_queue(src, None, x, y, x, y, w, h, pixel);
+}
+
+/* Makes root_bg the root background again, announcing it if configured */
+static void root_bg_set(Display *dpy, Window root) {
+  XSetWindowBackgroundPixmap(dpy, root, root_bg);
+  if (publish_root_pixmap)
+    XChangeProperty(dpy, root, atoms[AtomXRootPmap], XA_PIXMAP, 32, PropModeReplace,
+                    (unsigned char *)&root_bg, 1);
+  root_bg_stale = 0;
+}
+
+/* Applies every queued update to the target window, or to root_bg followed
+ * by exposing the same area of the root window */
+static void present_flush(Drw *drw, Window win) {
+  if (win == root_bg && root_bg_stale)
+    root_bg_set(drw->dpy, drw->root);
+  own_gen = (own_gen + 1) % OWN_FLUSHES;
+  own_n[own_gen] = 0;
+  for (unsigned int i = 0; i < npresent; i++) {
+    const PresentRect *r = &present_rects[i];
+    if (r->dst != None) {
+      XCopyArea(drw->dpy, r->src, r->dst, argb.gc, r->sx, r->sy, r->w, r->h, r->dx, r->dy);
+      stats_pixels(r->w, r->h);
       continue;
-    if (XGetWindowProperty(dpy, root, atoms[i], 0L, 1L, False, AnyPropertyType, &type, &format,
-                           &nitems, &bytes_after, &data) == Success &&
-        data) {
-      if (type == XA_PIXMAP && format == 32 && nitems == 1) {
-        pixmap = *((Pixmap *)data);
-      }
-      XFree(data);
-      data = NULL;
     }
-    if (pixmap != None)
-      break;
+    if (r->src == drw->drawable && r->sx == r->dx && r->sy == r->dy) {
+      drw_map(drw, win, r->dx, r->dy, r->w, r->h);
+    } else if (r->src == None) {
+      XSetForeground(drw->dpy, drw->gc, r->pixel);
+      XFillRectangle(drw->dpy, win, drw->gc, r->dx, r->dy, r->w, r->h);
+    } else if (r->src != win) {
+      XCopyArea(drw->dpy, r->src, win, drw->gc, r->sx, r->sy, r->w, r->h, r->dx, r->dy);
+      stats_pixels(r->w, r->h);
+    }
+    if (win == root_bg)
+      XClearArea(drw->dpy, drw->root, r->dx, r->dy, r->w, r->h, False);
+    if (win == root_bg || win == drw->root)
+      own_add(r->dx, r->dy, r->w, r->h);
+  }
+  npresent = 0;
+  present_merged = 0;
+  /* one flush for all monitors; completion is only checked next frame */
+  fence_submit(drw->dpy);
+}
+
+static void set_draw_clip(Drw *drw, XRectangle *r) {
+  draw_clip = r;
+  if (r)
+    XSetClipRectangles(drw->dpy, drw->gc, 0, 0, r, 1, Unsorted);
+  else
+    XSetClipMask(drw->dpy, drw->gc, None);
+}
+
+/* The wallpaper pixmap as last announced on the root window. Only a
+ * PropertyNotify for one of the wallpaper atoms makes us ask again, and
+ * root_bg announced by ourselves is not a new wallpaper. */
+static Pixmap wallpaper_pixmap(Display *dpy, Window root) {
+  if (wallpaper_dirty) {
+    Pixmap pm = get_root_pixmap(dpy, root);
+    wallpaper_dirty = 0;
+    if (pm != None && pm == root_bg)
+      return wallpaper_cached;
+    /* a wallpaper setter also replaces the root background */
+    root_bg_stale = root_bg != None;
+    wallpaper_cached = pm;
+    wallpaper_gen++;
+    mon_state_invalidate();
   }
+  return wallpaper_cached;
+}
 
-  return pixmap;
+/* Without a wallpaper pixmap the copy and blend modes sample what the root
+ * window shows, which includes the clock drawn last time. This keeps a clean
+ * copy of it instead. Outside the clock blocks it follows DAMAGE on the root,
+ * copied once per frame with the GC clipping by children, so what windows
+ * draw over the root is never taken. Inside a block the root only shows
+ * the background again after an Expose, which is when that part is taken. */
+static struct {
+  int checked;
+  int event_base; /* -1 without the DAMAGE extension */
+  Pixmap pm;
+  unsigned int w, h;
+  GC gc;
+  Damage damage;
+  int damaged; /* damage reported since the last frame */
+} bgcache;
+
+static void bgcache_free(Display *dpy) {
+  if (bgcache.pm == None)
+    return;
+  XDamageDestroy(dpy, bgcache.damage);
+  XFreeGC(dpy, bgcache.gc);
+  XFreePixmap(dpy, bgcache.pm);
+  bgcache.pm = None;
+  bgcache.damage = None;
+  bgcache.gc = NULL;
+  bgcache.damaged = 0;
+}
+
+/* The clock block monitor i last put on screen */
+static int mon_block(int i, XRectangle *r) {
+  const BlockLayout *l = &mon_state[i].layout;
+  if (!mon_state[i].valid || l->bw == 0 || l->bh == 0)
+    return 0;
+  r->x = (short)l->bx;
+  r->y = (short)l->by;
+  r->width = (unsigned short)l->bw;
+  r->height = (unsigned short)l->bh;
+  return 1;
+}
+
+/* Has the next frame repaint the part of r over monitor i's block, even if
+ * the text there did not change. Returns nonzero if there is such a part. */
+static int mon_refresh(int i, const XRectangle *r) {
+  XRectangle b, *f = &mon_state[i].refresh;
+  if (!mon_block(i, &b) || !rect_intersects(&b, r))
+    return 0;
+  int x0 = MAX(b.x, r->x), y0 = MAX(b.y, r->y);
+  int x1 = MIN(b.x + b.width, r->x + r->width), y1 = MIN(b.y + b.height, r->y + r->height);
+  if (f->width > 0 && f->height > 0) {
+    x0 = MIN(x0, f->x);
+    y0 = MIN(y0, f->y);
+    x1 = MAX(x1, f->x + f->width);
+    y1 = MAX(y1, f->y + f->height);
+  }
+  f->x = (short)x0;
+  f->y = (short)y0;
+  f->width = (unsigned short)(x1 - x0);
+  f->height = (unsigned short)(y1 - y0);
+  return 1;
+}
+
+/* Clears monitor i's block back to the root background and copies that */
+static void bgcache_take_block(Drw *drw, int i) {
+  XRectangle b;
+  if (!mon_block(i, &b))
+    return;
+  XClearArea(drw->dpy, drw->root, b.x, b.y, b.width, b.height, False);
+  own_add(b.x, b.y, b.width, b.height);
+  XCopyArea(drw->dpy, drw->root, bgcache.pm, bgcache.gc, b.x, b.y, b.width, b.height, b.x, b.y);
+  stats_pixels(b.width, b.height);
+  mon_refresh(i, &b);
+}
+
+/* Returns the clean copy of the root window, taking it first if needed, or
+ * the root window itself without DAMAGE */
+static Drawable bgcache_prepare(Drw *drw) {
+  Display *dpy = drw->dpy;
+  unsigned int w = DisplayWidth(dpy, drw->screen), h = DisplayHeight(dpy, drw->screen);
+  int error_base;
+
+  if (!bgcache.checked) {
+    bgcache.checked = 1;
+    if (!XDamageQueryExtension(dpy, &bgcache.event_base, &error_base))
+      bgcache.event_base = -1;
+  }
+  if (bgcache.event_base < 0)
+    return drw->root;
+  if (bgcache.pm != None && bgcache.w == w && bgcache.h == h)
+    return bgcache.pm;
+
+  Pixmap pm = XCreatePixmap(dpy, drw->root, w, h, DefaultDepth(dpy, drw->screen));
+  if (!bgcache.gc) {
+    XGCValues gcv;
+    gcv.graphics_exposures = False;
+    bgcache.gc = XCreateGC(dpy, pm, GCGraphicsExposures, &gcv);
+    /* one event until the damage is subtracted, however much is drawn */
+    bgcache.damage = XDamageCreate(dpy, drw->root, XDamageReportNonEmpty);
+  }
+  /* what windows cover stays black until it is uncovered */
+  XSetForeground(dpy, bgcache.gc, BlackPixel(dpy, drw->screen));
+  XFillRectangle(dpy, pm, bgcache.gc, 0, 0, w, h);
+  if (bgcache.pm != None) {
+    /* the screen was resized: keep the clean part, take only what is new */
+    unsigned int ow = MIN(bgcache.w, w), oh = MIN(bgcache.h, h);
+    XCopyArea(dpy, bgcache.pm, pm, bgcache.gc, 0, 0, ow, oh, 0, 0);
+    XCopyArea(dpy, drw->root, pm, bgcache.gc, (int)ow, 0, w - ow, h, (int)ow, 0);
+    XCopyArea(dpy, drw->root, pm, bgcache.gc, 0, (int)oh, ow, h - oh, 0, (int)oh);
+    XFreePixmap(dpy, bgcache.pm);
+    bgcache.pm = pm;
+  } else {
+    XCopyArea(dpy, drw->root, pm, bgcache.gc, 0, 0, w, h, 0, 0);
+    bgcache.pm = pm;
+    if (root_bg == None) {
+      for (int i = 0; i < MAX(cached_monitor_count, 1); i++)
+        bgcache_take_block(drw, i);
+    }
+  }
+  stats_pixels(w, h);
+  bgcache.w = w;
+  bgcache.h = h;
+  wallpaper_gen++;
+  return bgcache.pm;
+}
+
+/* Copies what clip covers of the root into the clean copy, leaving out
+ * what rootclock itself may have drawn there */
+static void bgcache_copy(Display *dpy, Window root, XserverRegion clip) {
+  XserverRegion own = own_region(dpy);
+  XFixesSubtractRegion(dpy, clip, clip, own);
+  XFixesSetGCClipRegion(dpy, bgcache.gc, 0, 0, clip);
+  XCopyArea(dpy, root, bgcache.pm, bgcache.gc, 0, 0, bgcache.w, bgcache.h, 0, 0);
+  XSetClipMask(dpy, bgcache.gc, None);
+  XFixesDestroyRegion(dpy, own);
+}
+
+/* The server has just repainted e's area of the root with its background:
+ * take it, and have the blocks it wiped repainted. Returns nonzero if it
+ * touched a block. */
+static int bgcache_expose(Display *dpy, Window root, const XExposeEvent *e) {
+  XRectangle r = {(short)e->x, (short)e->y, (unsigned short)e->width, (unsigned short)e->height};
+  int hit = 0;
+
+  if (bgcache.pm == None)
+    return 0;
+  XserverRegion clip = XFixesCreateRegion(dpy, &r, 1);
+  bgcache_copy(dpy, root, clip);
+  XFixesDestroyRegion(dpy, clip);
+  stats_pixels(r.width, r.height);
+  for (int i = 0; i < MAX(cached_monitor_count, 1); i++)
+    hit |= mon_refresh(i, &r);
+  if (hit)
+    wallpaper_gen++;
+  return hit;
+}
+
+/* Brings the clean copy up to date with the damage reported since the last
+ * frame. The blocks are masked out, they show the clock until exposed, so
+ * nothing read from under them changes. */
+static void bgcache_update(Drw *drw) {
+  Display *dpy = drw->dpy;
+  XRectangle blocks[MAX_MONITORS];
+  int nblocks = 0;
+
+  if (bgcache.pm == None || !bgcache.damaged)
+    return;
+  bgcache.damaged = 0;
+  XserverRegion clip = XFixesCreateRegion(dpy, NULL, 0);
+  XDamageSubtract(dpy, bgcache.damage, None, clip);
+  for (int i = 0; i < MAX(cached_monitor_count, 1); i++) {
+    if (mon_block(i, &blocks[nblocks]))
+      nblocks++;
+  }
+  XserverRegion mask = XFixesCreateRegion(dpy, blocks, nblocks);
+  XFixesSubtractRegion(dpy, clip, clip, mask);
+  bgcache_copy(dpy, drw->root, clip);
+  XFixesDestroyRegion(dpy, mask);
+  XFixesDestroyRegion(dpy, clip);
+}
+
+/* Creates root_bg for a w x h screen, starting from the wallpaper (or
+ * pixel), and installs it as the root background */
+static void root_bg_install(Drw *drw, unsigned long pixel, unsigned int w, unsigned int h) {
+  if (root_bg != None && root_bg_w == w && root_bg_h == h)
+    return;
+  Drawable wallpaper = wallpaper_pixmap(drw->dpy, drw->root);
+  /* without one, start from what the root showed before rootclock took it */
+  if (wallpaper == None && bg_mode != BG_MODE_SOLID) {
+    wallpaper = bgcache_prepare(drw);
+    if (wallpaper == drw->root)
+      wallpaper = None;
+  }
+  if (root_bg != None)
+    XFreePixmap(drw->dpy, root_bg);
+  root_bg = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+  root_bg_w = w;
+  root_bg_h = h;
+  XSetForeground(drw->dpy, drw->gc, pixel);
+  XFillRectangle(drw->dpy, root_bg, drw->gc, 0, 0, w, h);
+  if (wallpaper != None)
+    XCopyArea(drw->dpy, wallpaper, root_bg, drw->gc, 0, 0, w, h, 0, 0);
+  root_bg_set(drw->dpy, drw->root);
+  mon_state_invalidate();
+}
+
+/* Hands the root background (and _XROOTPMAP_ID) back to the wallpaper */
+static void root_bg_uninstall(Drw *drw) {
+  if (root_bg == None)
+    return;
+  Pixmap wallpaper = wallpaper_pixmap(drw->dpy, drw->root);
+  XSetWindowBackgroundPixmap(drw->dpy, drw->root, wallpaper);
+  if (publish_root_pixmap && wallpaper != None)
+    XChangeProperty(drw->dpy, drw->root, atoms[AtomXRootPmap], XA_PIXMAP, 32, PropModeReplace,
+                    (unsigned char *)&wallpaper, 1);
+  else if (publish_root_pixmap)
+    XDeleteProperty(drw->dpy, drw->root, atoms[AtomXRootPmap]);
+  XClearWindow(drw->dpy, drw->root);
+  XFreePixmap(drw->dpy, root_bg);
+  root_bg = None;
+  root_bg_stale = 0;
+}
+
+static int is_wallpaper_atom(Atom atom) {
+  return atom != None && (atom == atoms[AtomXRootPmap] || atom == atoms[AtomEsetroot]);
 }
 
 static int is_blend_mode(int mode) {
@@ -187,7 +974,7 @@ static int prepare_background(Drw *drw, Drawable src_drawable, int rx, int ry, u
   int used_solid = 1;
   XSetFunction(drw->dpy, drw->gc, GXcopy);
 
-  switch (background_mode) {
+  switch (bg_mode) {
   case BG_MODE_COPY:
   case BG_MODE_INVERT:
   case BG_MODE_MULTIPLY:
@@ -202,7 +989,9 @@ static int prepare_background(Drw *drw, Drawable src_drawable, int rx, int ry, u
     }
 
     used_solid = 0;
-    XCopyArea(drw->dpy, src_drawable, drw->drawable, drw->gc, rx, ry, rw, rh, rx, ry);
+    XCopyArea(drw->dpy, src_drawable, drw->drawable, drw->gc, rx + draw_org_x, ry + draw_org_y,
+              rw, rh, rx, ry);
+    stats_pixels(rw, rh);
   } break;
   case BG_MODE_SOLID:
   default:
@@ -214,14 +1003,49 @@ static int prepare_background(Drw *drw, Drawable src_drawable, int rx, int ry, u
   return used_solid;
 }
 
-static int compositor_is_active(Display *dpy, int screen) {
-  char sel_name[32];
-  snprintf(sel_name, sizeof sel_name, "_NET_WM_CM_S%d", screen);
-  Atom sel = XInternAtom(dpy, sel_name, False);
-  if (sel == None) {
+static void query_compositor(Display *dpy, Atom sel) {
+  xcb_connection_t *c = XGetXCBConnection(dpy);
+  if (sel == None || query.owner_pending)
+    return;
+  query.owner = xcb_get_selection_owner(c, (xcb_atom_t)sel);
+  stats_xcb_request(query.owner.sequence, sizeof(xcb_get_selection_owner_request_t));
+  query.owner_pending = 1;
+  query.inflight = 1;
+}
+
+static int collect_compositor(Display *dpy) {
+  xcb_generic_error_t *err = NULL;
+  xcb_get_selection_owner_reply_t *r;
+  int owned;
+
+  if (!query.owner_pending)
     return 0;
-  }
-  return XGetSelectionOwner(dpy, sel) != None;
+  query_wait();
+  query.owner_pending = 0;
+  r = xcb_get_selection_owner_reply(XGetXCBConnection(dpy), query.owner, &err);
+  free(err);
+  owned = r && r->owner != XCB_NONE;
+  free(r);
+  return owned;
+}
+
+static int compositor_is_active(Display *dpy, Atom sel) {
+  query_compositor(dpy, sel);
+  return collect_compositor(dpy);
+}
+
+/* Asks for XFixes notifications whenever the compositor selection changes
+ * hands, so compositor presence never has to be polled. Returns the XFixes
+ * event base, or -1 when the extension is missing. */
+static int compositor_watch(Display *dpy, Window root, Atom sel) {
+  int event_base, error_base;
+  if (sel == None || !XFixesQueryExtension(dpy, &event_base, &error_base))
+    return -1;
+  XFixesSelectSelectionInput(dpy, root, sel,
+                             XFixesSetSelectionOwnerNotifyMask |
+                                 XFixesSelectionWindowDestroyNotifyMask |
+                                 XFixesSelectionClientCloseNotifyMask);
+  return event_base;
 }
 
 static Window create_desktop_window(Display *dpy, int screen, Window root, unsigned int w,
@@ -239,19 +1063,10 @@ static Window create_desktop_window(Display *dpy, int screen, Window root, unsig
     return None;
   }
 
-  Atom type_atom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
-  Atom type_desktop = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
-  if (type_atom != None && type_desktop != None) {
-    XChangeProperty(dpy, win, type_atom, XA_ATOM, 32, PropModeReplace,
-                    (unsigned char *)&type_desktop, 1);
-  }
-
-  Atom state_atom = XInternAtom(dpy, "_NET_WM_STATE", False);
-  Atom state_below = XInternAtom(dpy, "_NET_WM_STATE_BELOW", False);
-  if (state_atom != None && state_below != None) {
-    XChangeProperty(dpy, win, state_atom, XA_ATOM, 32, PropModeReplace,
-                    (unsigned char *)&state_below, 1);
-  }
+  XChangeProperty(dpy, win, atoms[AtomWmType], XA_ATOM, 32, PropModeReplace,
+                  (unsigned char *)&atoms[AtomWmTypeDesktop], 1);
+  XChangeProperty(dpy, win, atoms[AtomWmState], XA_ATOM, 32, PropModeReplace,
+                  (unsigned char *)&atoms[AtomWmStateBelow], 1);
 
   XMapWindow(dpy, win);
   XLowerWindow(dpy, win);
@@ -267,6 +1082,88 @@ static void destroy_desktop_window(Display *dpy, Window *win) {
   }
 }
 
+/* Finds a 32-bit ARGB visual and sets up what drawing for it needs, once.
+ * Returns 0 when the server has none. */
+static int argb_init(Display *dpy, int screen, Window root) {
+  XVisualInfo vi;
+
+  if (argb.visual || argb.unavailable)
+    return argb.visual != NULL;
+  XRenderPictFormat *fmt = NULL;
+  if (XMatchVisualInfo(dpy, screen, 32, TrueColor, &vi))
+    fmt = XRenderFindVisualFormat(dpy, vi.visual);
+  if (!fmt || fmt->type != PictTypeDirect || !fmt->direct.alphaMask) {
+    fprintf(stderr, "rootclock: no 32-bit ARGB visual, using one desktop window\n");
+    argb.unavailable = 1;
+    return 0;
+  }
+  argb.visual = vi.visual;
+  argb.fmt = fmt;
+  argb.cmap = XCreateColormap(dpy, root, vi.visual, AllocNone);
+  Pixmap pm = XCreatePixmap(dpy, root, 1, 1, 32);
+  argb.gc = XCreateGC(dpy, pm, 0, NULL);
+  XFreePixmap(dpy, pm);
+  return 1;
+}
+
+/* Maps monitor i's ARGB window over r, or moves it there. It stays out of
+ * the way of input, and nothing is drawn before its first frame arrives. */
+static void argb_place(Display *dpy, Window root, int i, const XRectangle *r) {
+  XRectangle *g = &argb.geom[i];
+
+  if (argb.win[i] != None) {
+    if (g->x != r->x || g->y != r->y || g->width != r->width || g->height != r->height)
+      XMoveResizeWindow(dpy, argb.win[i], r->x, r->y, r->width, r->height);
+    *g = *r;
+    return;
+  }
+
+  XSetWindowAttributes swa;
+  memset(&swa, 0, sizeof swa);
+  swa.override_redirect = True;
+  swa.background_pixel = 0;
+  swa.border_pixel = 0;
+  swa.colormap = argb.cmap;
+  swa.event_mask = ExposureMask;
+  Window win = XCreateWindow(dpy, root, r->x, r->y, r->width, r->height, 0, 32, InputOutput,
+                             argb.visual,
+                             CWOverrideRedirect | CWBackPixel | CWBorderPixel | CWColormap |
+                                 CWEventMask,
+                             &swa);
+  if (!win)
+    return;
+  XChangeProperty(dpy, win, atoms[AtomWmType], XA_ATOM, 32, PropModeReplace,
+                  (unsigned char *)&atoms[AtomWmTypeDesktop], 1);
+  XChangeProperty(dpy, win, atoms[AtomWmState], XA_ATOM, 32, PropModeReplace,
+                  (unsigned char *)&atoms[AtomWmStateBelow], 1);
+  XserverRegion none = XFixesCreateRegion(dpy, NULL, 0);
+  XFixesSetWindowShapeRegion(dpy, win, ShapeInput, 0, 0, none);
+  XFixesDestroyRegion(dpy, none);
+  XMapWindow(dpy, win);
+  XLowerWindow(dpy, win);
+  argb.win[i] = win;
+  *g = *r;
+}
+
+static int is_argb_window(Window win) {
+  for (int i = 0; i < MAX_MONITORS && win != None; i++) {
+    if (argb.win[i] == win)
+      return 1;
+  }
+  return 0;
+}
+
+static void argb_free(Display *dpy) {
+  argb_destroy(dpy, 0);
+  if (argb.src != None)
+    XRenderFreePicture(dpy, argb.src);
+  if (argb.gc)
+    XFreeGC(dpy, argb.gc);
+  if (argb.visual)
+    XFreeColormap(dpy, argb.cmap);
+  memset(&argb, 0, sizeof argb);
+}
+
 static Fnt *fontset_xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern) {
   Fnt *font;
   XftFont *xfont = NULL;
@@ -309,6 +1206,42 @@ static void fontset_xfont_free(Fnt *font) {
   free(font);
 }
 
+static Fnt *fontset_nth(Fnt *set, int i) {
+  if (i < 0)
+    return NULL;
+  while (set && i-- > 0)
+    set = set->next;
+  return set;
+}
+
+/* Reopens a fontset the font cache recorded, fallbacks included and in the
+ * same order, straight from the matched patterns so fontconfig never has to
+ * match. Returns NULL when a font cannot be opened any more. */
+static Fnt *fontset_from_cache(Drw *drw, const FcacheSet *cs) {
+  Fnt *set = NULL, **tail = &set;
+
+  for (unsigned int i = 0; i < cs->nfonts; i++) {
+    FcPattern *match = FcNameParse((const FcChar8 *)cs->fonts[i].resolved);
+    FcPattern *pattern = NULL;
+    Fnt *f = NULL;
+    if (match && !(f = fontset_xfont_create(drw, NULL, match)))
+      FcPatternDestroy(match);
+    if (f && *cs->fonts[i].pattern &&
+        !(pattern = FcNameParse((const FcChar8 *)cs->fonts[i].pattern))) {
+      fontset_xfont_free(f);
+      f = NULL;
+    }
+    if (!f) {
+      drw_fontset_free(set);
+      return NULL;
+    }
+    f->pattern = pattern;
+    *tail = f;
+    tail = &f->next;
+  }
+  return set;
+}
+
 enum DrawTargetType {
   DRAW_TARGET_NORMAL,
   DRAW_TARGET_ALPHA8,
@@ -352,6 +1285,8 @@ static int draw_text_core(Drw *drw, Drawable drawable, Visual *visual, Colormap
     switch (target_type) {
     case DRAW_TARGET_NORMAL:
       d = XftDrawCreate(drw->dpy, drawable, visual, colormap);
+      if (d && draw_clip && drawable == drw->drawable)
+        XftDrawSetClipRectangles(d, 0, 0, draw_clip, 1);
       break;
     case DRAW_TARGET_ALPHA8:
       d = XftDrawCreateAlpha(drw->dpy, drawable, 8);
@@ -491,146 +1426,1408 @@ static int draw_text_core(Drw *drw, Drawable drawable, Visual *visual, Colormap
   return x + (render ? w : 0);
 }
 
-static int draw_text_custom(Drw *drw, int x, int y, unsigned int w, unsigned int h,
-                            unsigned int lpad, const char *text, int invert, int fill_bg) {
-  if (fill_bg)
-    return drw_text(drw, x, y, w, h, lpad, text, invert);
+/* Render resources that outlive a frame: the Picture wrapping drw->drawable,
+ * one solid-fill source per colour and a grow-only A8 coverage mask shared by
+ * all blend draws. The destination Picture follows drw->drawable, so it has
+ * to be dropped whenever drw_resize replaces the pixmap. */
+typedef struct {
+  DstPicture dst;
+  Pixmap mask;
+  Picture mask_pic;
+  GC mask_gc;
+  unsigned int mask_w, mask_h;
+  struct {
+    XRenderColor rc;
+    Picture pic;
+  } fills[RCACHE_FILLS];
+  int nfills, next_fill;
+} RenderCache;
+
+static RenderCache rcache;
+
+static void rcache_drop_dst(Display *dpy) { dst_picture_free(dpy, &rcache.dst); }
+
+static void rcache_drop_mask(Display *dpy) {
+  if (rcache.mask_pic != None)
+    XRenderFreePicture(dpy, rcache.mask_pic);
+  if (rcache.mask_gc)
+    XFreeGC(dpy, rcache.mask_gc);
+  if (rcache.mask != None)
+    XFreePixmap(dpy, rcache.mask);
+  rcache.mask_pic = None;
+  rcache.mask_gc = NULL;
+  rcache.mask = None;
+  rcache.mask_w = rcache.mask_h = 0;
+}
 
-  return draw_text_core(drw, drw->drawable, DefaultVisual(drw->dpy, drw->screen),
-                        DefaultColormap(drw->dpy, drw->screen), DRAW_TARGET_NORMAL, NULL, x, y, w,
-                        h, lpad, text, invert, 0);
+static void rcache_free(Display *dpy) {
+  rcache_drop_dst(dpy);
+  rcache_drop_mask(dpy);
+  for (int i = 0; i < rcache.nfills; i++)
+    XRenderFreePicture(dpy, rcache.fills[i].pic);
+  memset(&rcache, 0, sizeof rcache);
 }
 
-static void draw_text_mask(Drw *drw, Pixmap mask, int x, int y, unsigned int w, unsigned int h,
-                           const char *text) {
-  XRenderColor rc = {0xffff, 0xffff, 0xffff, 0xffff};
-  XftColor color;
-  color.color = rc;
-  color.pixel = 1;
-  draw_text_core(drw, mask, NULL, None, DRAW_TARGET_ALPHA8, &color, x, y, w, h, 0, text, 0, 0);
+/* Picture for drw->drawable, clipped to draw_clip when one is active. A
+ * bound block buffer keeps its own, so monitors do not fight over one. */
+static Picture rcache_dst(Drw *drw) {
+  DstPicture *d = draw_buf ? &draw_buf->dst : &rcache.dst;
+  if (d->pic != None && d->drawable != drw->drawable)
+    dst_picture_free(drw->dpy, d);
+  if (d->pic == None) {
+    Visual *visual = DefaultVisual(drw->dpy, drw->screen);
+    XRenderPictFormat *fmt =
+        draw_buf && draw_buf->argb ? argb.fmt : XRenderFindVisualFormat(drw->dpy, visual);
+    if (!fmt)
+      return None;
+    d->pic = XRenderCreatePicture(drw->dpy, drw->drawable, fmt, 0, NULL);
+    d->drawable = drw->drawable;
+  }
+  if (draw_clip) {
+    XRenderSetPictureClipRectangles(drw->dpy, d->pic, 0, 0, draw_clip, 1);
+    d->clipped = 1;
+  } else if (d->clipped) {
+    XRenderPictureAttributes pa;
+    pa.clip_mask = None;
+    XRenderChangePicture(drw->dpy, d->pic, CPClipMask, &pa);
+    d->clipped = 0;
+  }
+  return d->pic;
 }
 
-static int apply_effect_for_text(Drw *drw, int mode, int text_x, int text_y, unsigned int text_w,
-                                 unsigned int text_h, const char *text, Fnt *font,
-                                 const Clr *fg_clr) {
-  if (!text || !*text || text_w == 0 || text_h == 0 || !drw || !font)
-    return 0;
+static Picture rcache_fill(Display *dpy, const XRenderColor *rc) {
+  for (int i = 0; i < rcache.nfills; i++) {
+    if (!memcmp(&rcache.fills[i].rc, rc, sizeof *rc))
+      return rcache.fills[i].pic;
+  }
+  int slot = rcache.nfills;
+  if (slot == RCACHE_FILLS) {
+    slot = rcache.next_fill;
+    rcache.next_fill = (rcache.next_fill + 1) % RCACHE_FILLS;
+    XRenderFreePicture(dpy, rcache.fills[slot].pic);
+  } else {
+    rcache.nfills++;
+  }
+  rcache.fills[slot].rc = *rc;
+  rcache.fills[slot].pic = XRenderCreateSolidFill(dpy, rc);
+  return rcache.fills[slot].pic;
+}
 
+/* Returns the shared A8 mask with at least w x h cleared pixels at 0,0 */
+static Pixmap rcache_mask(Drw *drw, unsigned int w, unsigned int h, Picture *pic) {
   Display *dpy = drw->dpy;
-  /* Blend paths allocate a fresh coverage mask per draw. These regions are
-   * large but infrequent compared to the overall render time; if profiling ever
-   * shows this as a bottleneck we can pool pixmaps keyed by dimensions. */
-  Pixmap mask = XCreatePixmap(dpy, drw->root, text_w, text_h, 8);
-  if (!mask)
-    return 0;
-
-  GC mask_gc = XCreateGC(dpy, mask, 0, NULL);
-  if (!mask_gc) {
-    XFreePixmap(dpy, mask);
-    return 0;
+  if (w > rcache.mask_w || h > rcache.mask_h) {
+    XRenderPictFormat *fmt = XRenderFindStandardFormat(dpy, PictStandardA8);
+    unsigned int mw = MAX(w, rcache.mask_w), mh = MAX(h, rcache.mask_h);
+    if (!fmt)
+      return None;
+    rcache_drop_mask(dpy);
+    mw = (mw + RCACHE_MASK_ALIGN - 1) & ~(RCACHE_MASK_ALIGN - 1U);
+    mh = (mh + RCACHE_MASK_ALIGN - 1) & ~(RCACHE_MASK_ALIGN - 1U);
+    rcache.mask = XCreatePixmap(dpy, drw->root, mw, mh, 8);
+    if (!rcache.mask)
+      return None;
+    rcache.mask_gc = XCreateGC(dpy, rcache.mask, 0, NULL);
+    XSetForeground(dpy, rcache.mask_gc, 0);
+    rcache.mask_pic = XRenderCreatePicture(dpy, rcache.mask, fmt, 0, NULL);
+    rcache.mask_w = mw;
+    rcache.mask_h = mh;
   }
-  XSetForeground(dpy, mask_gc, 0);
-  XFillRectangle(dpy, mask, mask_gc, 0, 0, text_w, text_h);
-  XFreeGC(dpy, mask_gc);
-
-  Fnt *prev_font = drw->fonts;
-  drw_setfontset(drw, font);
-  draw_text_mask(drw, mask, 0, 0, text_w, text_h, text);
-  drw_setfontset(drw, prev_font);
+  XFillRectangle(dpy, rcache.mask, rcache.mask_gc, 0, 0, w, h);
+  *pic = rcache.mask_pic;
+  return rcache.mask;
+}
 
-  int success = 0;
-  switch (mode) {
-  case BG_MODE_INVERT:
-  case BG_MODE_MULTIPLY:
-  case BG_MODE_SCREEN:
-  case BG_MODE_OVERLAY:
-  case BG_MODE_DARKEN:
-  case BG_MODE_LIGHTEN: {
-    XRenderPictFormat *dst_fmt = XRenderFindVisualFormat(dpy, DefaultVisual(dpy, drw->screen));
-    XRenderPictFormat *mask_fmt = XRenderFindStandardFormat(dpy, PictStandardA8);
-    if (!dst_fmt || !mask_fmt)
-      break;
+/* Glyph atlas: every glyph a format string can produce is rasterised once at
+ * startup and uploaded into a server-side GlyphSet. A frame then only maps the
+ * formatted string to glyph ids and issues one composite request per line. */
+typedef struct {
+  long cp;
+  Glyph gid;
+  int xoff;
+  unsigned char *bits; /* client copy of the A8 image for atlas_coverage */
+  unsigned short w, h, stride;
+  short x, y; /* origin offset as in XGlyphInfo */
+} AtlasGlyph;
+
+typedef struct {
+  Fnt *set; /* fontset the glyphs were resolved against */
+  GlyphSet gs;
+  XRenderPictFormat *fmt;
+  int ascent;
+  AtlasGlyph glyphs[ATLAS_MAX_GLYPHS]; /* sorted by codepoint */
+  int n;
+} GlyphAtlas;
+
+static GlyphAtlas time_atlas, date_atlas;
+
+static GlyphAtlas *atlas_for(Fnt *set) {
+  if (set && time_atlas.gs != None && time_atlas.set == set)
+    return &time_atlas;
+  if (set && date_atlas.gs != None && date_atlas.set == set)
+    return &date_atlas;
+  return NULL;
+}
 
-    Picture dst = XRenderCreatePicture(dpy, drw->drawable, dst_fmt, 0, NULL);
-    Picture mask_pic = XRenderCreatePicture(dpy, mask, mask_fmt, 0, NULL);
-    Picture src = None;
+static const AtlasGlyph *atlas_lookup(const GlyphAtlas *a, long cp) {
+  int lo = 0, hi = a->n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (a->glyphs[mid].cp == cp)
+      return &a->glyphs[mid];
+    if (a->glyphs[mid].cp < cp)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
 
-    XRenderColor rc = clr_to_xrender(fg_clr);
-    src = XRenderCreateSolidFill(dpy, &rc);
+/* Maps text to glyph ids. Returns the glyph count, or -1 when a codepoint is
+ * not in the atlas and the caller has to take the Xft path. */
+static int atlas_map(const GlyphAtlas *a, const char *text, unsigned int *gids, int max,
+                     unsigned int *width) {
+  int n = 0, err;
+  long cp;
+  unsigned int w = 0;
+
+  while (*text) {
+    text += utf8decode(text, &cp, &err);
+    const AtlasGlyph *g = err ? NULL : atlas_lookup(a, cp);
+    if (!g || n >= max)
+      return -1;
+    gids[n++] = (unsigned int)g->gid;
+    w += (unsigned int)g->xoff;
+  }
+  if (width)
+    *width = w;
+  return n;
+}
 
-    int op = PictOpOver;
-    switch (mode) {
-    case BG_MODE_INVERT:
-      op = PictOpDifference;
-      break;
-    case BG_MODE_MULTIPLY:
-      op = PictOpMultiply;
-      break;
-    case BG_MODE_SCREEN:
-      op = PictOpScreen;
-      break;
-    case BG_MODE_OVERLAY:
-      op = PictOpOverlay;
-      break;
-    case BG_MODE_DARKEN:
-      op = PictOpDarken;
-      break;
-    case BG_MODE_LIGHTEN:
-      op = PictOpLighten;
-      break;
-    default:
-      break;
-    }
+static int atlas_width(Fnt *set, const char *text, unsigned int *width) {
+  unsigned int gids[ATLAS_MAX_LINE];
+  GlyphAtlas *a = atlas_for(set);
+  return a && text && atlas_map(a, text, gids, LENGTH(gids), width) >= 0;
+}
 
-    XRenderComposite(dpy, op, src, mask_pic, dst, 0, 0, 0, 0, text_x, text_y, text_w, text_h);
+static void atlas_add_codepoints(const char *s, long *cps, int *n, int max) {
+  int err;
+  long cp;
 
-    if (src != None)
-      XRenderFreePicture(dpy, src);
-    XRenderFreePicture(dpy, mask_pic);
-    XRenderFreePicture(dpy, dst);
-    success = 1;
-  } break;
-  default:
-    break;
+  while (*s) {
+    s += utf8decode(s, &cp, &err);
+    if (err)
+      continue;
+    int seen = 0;
+    for (int i = 0; i < *n && !seen; i++)
+      seen = cps[i] == cp;
+    if (!seen && *n < max)
+      cps[(*n)++] = cp;
   }
-
-  XFreePixmap(dpy, mask);
-  return success;
 }
 
-static void draw_block_for_region(Drw *drw, Window target_win, int rx, int ry, int rw, int rh,
-                                  Fnt *tf, Fnt *df, int show_date_flag, Clr *bg_scm, Clr *time_scm,
-                                  Clr *date_scm, const char *tstr, const char *dstr, int block_yoff,
-                                  int spacing, Pixmap wallpaper_pm) {
-  if (show_date_flag && (!df || !date_scm || !dstr)) {
-    fprintf(stderr, "rootclock: invalid parameters for date display\n");
-    return;
+/* Collects the codepoints fmt can expand to by formatting it for every month,
+ * weekday and half of the day. Anything this misses (e.g. a %Z that changes
+ * later) is simply drawn through Xft at render time. */
+static int atlas_collect(const char *fmt, long *cps, int max) {
+  char buf[DATE_BUF_SIZE];
+  time_t now = time(NULL);
+  struct tm base, tm;
+  int n = 0;
+
+  atlas_add_codepoints("0123456789 ", cps, &n, max);
+  if (!localtime_r(&now, &base))
+    memset(&base, 0, sizeof base);
+  for (int mon = 0; mon < 12; mon++) {
+    for (int wday = 0; wday < 7; wday++) {
+      for (int half = 0; half < 2; half++) {
+        tm = base;
+        tm.tm_mon = mon;
+        tm.tm_wday = wday;
+        tm.tm_mday = 1 + (mon * 7 + wday) % 31;
+        tm.tm_yday = mon * 30 + tm.tm_mday - 1;
+        tm.tm_hour = half ? 13 : 1;
+        if (strftime(buf, sizeof buf, fmt, &tm) > 0)
+          atlas_add_codepoints(buf, cps, &n, max);
+      }
+    }
   }
+  return n;
+}
 
-  int time_h = tf->h;
-  if (!tf->xfont) {
-    fprintf(stderr, "rootclock: invalid font configuration\n");
-    return;
+static Fnt *atlas_resolve_font(Drw *drw, Fnt *set, long cp) {
+  for (int pass = 0; pass < 2; pass++) {
+    for (Fnt *f = set; f; f = f->next) {
+      if (XftCharExists(drw->dpy, f->xfont, (FcChar32)cp))
+        return f;
+    }
+    if (pass == 0) {
+      /* let the regular measurement pass discover and append a fallback font */
+      char utf8[8] = {0};
+      FcUcs4ToUtf8((FcChar32)cp, (FcChar8 *)utf8);
+      drw_setfontset(drw, set);
+      draw_text_core(drw, drw->drawable, NULL, None, DRAW_TARGET_NORMAL, NULL, 0, 0, 0, 0, 0, utf8,
+                     0, 0);
+    }
   }
-  int ascent_t = tf->xfont->ascent;
+  return NULL;
+}
 
-  int date_h = 0;
-  if (show_date_flag && df) {
+/* The FreeType load flags and render mode Xft uses for a font, derived from
+ * its pattern the way XftFontInfoFill does, so atlas glyphs match what the
+ * Xft path draws. Returns 0 for what an A8 atlas cannot reproduce:
+ * emboldening, a transform, vertical layout or subpixel rendering. */
+static int atlas_load_flags(FcPattern *p, FT_Int32 *load, FT_Render_Mode *mode) {
+  FcBool antialias = FcTrue, hinting = FcTrue, autohint = FcFalse, embolden = FcFalse;
+  FcBool bitmap = FcFalse, vertical = FcFalse;
+  int hintstyle = FC_HINT_FULL, rgba = FC_RGBA_UNKNOWN;
+  FcMatrix *m;
+
+  FcPatternGetBool(p, FC_ANTIALIAS, 0, &antialias);
+  FcPatternGetBool(p, FC_HINTING, 0, &hinting);
+  FcPatternGetInteger(p, FC_HINT_STYLE, 0, &hintstyle);
+  FcPatternGetBool(p, FC_AUTOHINT, 0, &autohint);
+  FcPatternGetBool(p, FC_EMBOLDEN, 0, &embolden);
+  FcPatternGetBool(p, FC_EMBEDDED_BITMAP, 0, &bitmap);
+  FcPatternGetBool(p, FC_VERTICAL_LAYOUT, 0, &vertical);
+  FcPatternGetInteger(p, FC_RGBA, 0, &rgba);
+  if (embolden || vertical || (antialias && rgba != FC_RGBA_UNKNOWN && rgba != FC_RGBA_NONE))
+    return 0;
+  if (FcPatternGetMatrix(p, FC_MATRIX, 0, &m) == FcResultMatch &&
+      (m->xx != 1 || m->xy != 0 || m->yx != 0 || m->yy != 1))
+    return 0;
+
+  *load = FT_LOAD_DEFAULT;
+  if (antialias && !bitmap)
+    *load |= FT_LOAD_NO_BITMAP;
+  if (!hinting || hintstyle == FC_HINT_NONE)
+    *load |= FT_LOAD_NO_HINTING;
+  else if (!antialias)
+    *load |= FT_LOAD_TARGET_MONO;
+  else if (hintstyle == FC_HINT_SLIGHT)
+    *load |= FT_LOAD_TARGET_LIGHT;
+  if (autohint)
+    *load |= FT_LOAD_FORCE_AUTOHINT;
+  *mode = antialias ? FT_RENDER_MODE_NORMAL : FT_RENDER_MODE_MONO;
+  return 1;
+}
+
+static int atlas_upload(Drw *drw, GlyphAtlas *a, Fnt *f, long cp) {
+  Display *dpy = drw->dpy;
+  FT_UInt idx = XftCharIndex(dpy, f->xfont, (FcChar32)cp);
+  FT_Int32 load;
+  FT_Render_Mode mode;
+  XGlyphInfo ext;
+
+  /* such glyphs stay out of the atlas: text using them takes the Xft path */
+  if (!atlas_load_flags(f->xfont->pattern, &load, &mode))
+    return 0;
+  XftGlyphExtents(dpy, f->xfont, &idx, 1, &ext);
+
+  FT_Face face = XftLockFace(f->xfont);
+  if (!face)
+    return 0;
+  if (FT_Load_Glyph(face, idx, load) || FT_Render_Glyph(face->glyph, mode)) {
+    XftUnlockFace(f->xfont);
+    return 0;
+  }
+
+  FT_Bitmap *bm = &face->glyph->bitmap;
+  if (bm->pixel_mode != FT_PIXEL_MODE_GRAY && bm->pixel_mode != FT_PIXEL_MODE_MONO) {
+    XftUnlockFace(f->xfont);
+    return 0;
+  }
+
+  /* A8 glyph rows are padded to 32 bits */
+  unsigned int stride = (bm->width + 3U) & ~3U;
+  size_t size = (size_t)stride * bm->rows;
+  unsigned char *data = size ? ecalloc(1, size) : NULL;
+  /* a negative pitch means the buffer starts with the bottom row */
+  size_t pitch = (size_t)(bm->pitch < 0 ? -bm->pitch : bm->pitch);
+  for (unsigned int row = 0; row < bm->rows; row++) {
+    unsigned int from = bm->pitch < 0 ? bm->rows - 1 - row : row;
+    const unsigned char *src = bm->buffer + (size_t)from * pitch;
+    unsigned char *dst = data + (size_t)row * stride;
+    for (unsigned int col = 0; col < bm->width; col++) {
+      if (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+        dst[col] = (src[col >> 3] & (0x80 >> (col & 7))) ? 0xff : 0;
+      else
+        dst[col] = src[col];
+    }
+  }
+
+  /* fallback fonts are centred in the line like draw_text_core does, so bake
+   * their baseline shift relative to the primary font into the glyph */
+  int line_h = (int)a->set->h;
+  int dy = (line_h - (int)f->h) / 2 + f->xfont->ascent - a->ascent;
+
+  XGlyphInfo gi;
+  gi.width = (unsigned short)bm->width;
+  gi.height = (unsigned short)bm->rows;
+  gi.x = (short)-face->glyph->bitmap_left;
+  gi.y = (short)(face->glyph->bitmap_top - dy);
+  gi.xOff = ext.xOff;
+  gi.yOff = 0;
+  XftUnlockFace(f->xfont);
+
+  AtlasGlyph *g = &a->glyphs[a->n];
+  g->cp = cp;
+  g->gid = (Glyph)a->n;
+  g->xoff = ext.xOff;
+  g->bits = data;
+  g->w = gi.width;
+  g->h = gi.height;
+  g->stride = (unsigned short)stride;
+  g->x = gi.x;
+  g->y = gi.y;
+  XRenderAddGlyphs(dpy, a->gs, &g->gid, &gi, 1, (const char *)data, (int)size);
+  a->n++;
+  return 1;
+}
+
+static int atlas_glyph_cmp(const void *pa, const void *pb) {
+  const AtlasGlyph *ga = pa, *gb = pb;
+  return (ga->cp > gb->cp) - (ga->cp < gb->cp);
+}
+
+/* With cs the codepoints and the font covering each come from the font
+ * cache, so neither collection nor fallback discovery runs */
+static void atlas_build(Drw *drw, GlyphAtlas *a, Fnt *set, const char *fmt, const FcacheSet *cs) {
+  long cps[ATLAS_MAX_GLYPHS];
+  int ncp;
+
+  memset(a, 0, sizeof *a);
+  if (!set || !fmt)
+    return;
+  a->fmt = XRenderFindStandardFormat(drw->dpy, PictStandardA8);
+  if (!a->fmt)
+    return;
+  a->set = set;
+  a->ascent = set->xfont->ascent;
+  a->gs = XRenderCreateGlyphSet(drw->dpy, a->fmt);
+
+  Fnt *prev_font = drw->fonts;
+  if (cs) {
+    for (unsigned int i = 0; i < cs->nglyphs && a->n < ATLAS_MAX_GLYPHS; i++) {
+      Fnt *f = fontset_nth(set, cs->glyphs[i].font);
+      if (f)
+        atlas_upload(drw, a, f, cs->glyphs[i].cp);
+    }
+  } else {
+    ncp = atlas_collect(fmt, cps, LENGTH(cps));
+    for (int i = 0; i < ncp; i++) {
+      Fnt *f = atlas_resolve_font(drw, set, cps[i]);
+      if (f)
+        atlas_upload(drw, a, f, cps[i]);
+    }
+  }
+  drw_setfontset(drw, prev_font);
+  qsort(a->glyphs, (size_t)a->n, sizeof a->glyphs[0], atlas_glyph_cmp);
+}
+
+static void atlas_free(Display *dpy, GlyphAtlas *a) {
+  for (int i = 0; i < a->n; i++)
+    free(a->glyphs[i].bits);
+  if (a->gs != None)
+    XRenderFreeGlyphSet(dpy, a->gs);
+  memset(a, 0, sizeof *a);
+}
+
+/* Composites text from the atlas onto dst with its top-left at (x, y).
+ * Returns 0 when the atlas cannot render text. */
+static int atlas_draw(Drw *drw, Picture dst, int op, const XRenderColor *rc, int x, int y,
+                      const char *text) {
+  unsigned int gids[ATLAS_MAX_LINE];
+  GlyphAtlas *a = atlas_for(drw->fonts);
+  if (!a || dst == None)
+    return 0;
+  int n = atlas_map(a, text, gids, LENGTH(gids), NULL);
+  if (n < 0)
+    return 0;
+  if (n == 0)
+    return 1;
+
+  XRenderCompositeString32(drw->dpy, op, rcache_fill(drw->dpy, rc), dst, a->fmt, a->gs, 0, 0, x,
+                           y + a->ascent, gids, n);
+  return 1;
+}
+
+/* Client-side twin of atlas_draw with PictOpAdd into a cleared mask: writes
+ * the coverage of text into the w x h buffer cov. Returns 0 when the atlas
+ * cannot render text. */
+static int atlas_coverage(Fnt *set, const char *text, unsigned char *cov, int w, int h) {
+  GlyphAtlas *a = atlas_for(set);
+  int pen = 0, err;
+  long cp;
+
+  if (!a)
+    return 0;
+  memset(cov, 0, (size_t)w * h);
+  while (*text) {
+    text += utf8decode(text, &cp, &err);
+    const AtlasGlyph *g = err ? NULL : atlas_lookup(a, cp);
+    if (!g)
+      return 0;
+    int gx = pen - g->x, gy = a->ascent - g->y;
+    for (int row = MAX(0, -gy); row < g->h && gy + row < h; row++) {
+      const unsigned char *src = g->bits + (size_t)row * g->stride;
+      unsigned char *dst = cov + (size_t)(gy + row) * w;
+      for (int col = MAX(0, -gx); col < g->w && gx + col < w; col++) {
+        unsigned int v = dst[gx + col] + src[col];
+        dst[gx + col] = (unsigned char)MIN(v, 255U);
+      }
+    }
+    pen += g->xoff;
+  }
+  return 1;
+}
+
+static int draw_text_custom(Drw *drw, int x, int y, unsigned int w, unsigned int h,
+                            unsigned int lpad, const char *text, int invert, int fill_bg) {
+  unsigned int tw;
+  if (lpad == 0 && atlas_width(drw->fonts, text, &tw)) {
+    XRenderColor rc = clr_to_xrender(&drw->scheme[invert ? ColBg : ColFg]);
+    if (fill_bg)
+      drw_rect(drw, x, y, w, h, 1, !invert);
+    atlas_draw(drw, rcache_dst(drw), PictOpOver, &rc, x, y, text);
+    return x + w;
+  }
+
+  /* drw_text would bypass draw_clip, so fill and draw through draw_text_core */
+  int argb_buf = draw_buf && draw_buf->argb;
+  return draw_text_core(drw, drw->drawable,
+                        argb_buf ? argb.visual : DefaultVisual(drw->dpy, drw->screen),
+                        argb_buf ? argb.cmap : DefaultColormap(drw->dpy, drw->screen),
+                        DRAW_TARGET_NORMAL, NULL, x, y, w, h, lpad, text, invert, fill_bg);
+}
+
+static void draw_text_mask(Drw *drw, Pixmap mask, Picture mask_pic, int x, int y, unsigned int w,
+                           unsigned int h, const char *text) {
+  XRenderColor rc = {0xffff, 0xffff, 0xffff, 0xffff};
+  XftColor color;
+  if (atlas_draw(drw, mask_pic, PictOpAdd, &rc, x, y, text))
+    return;
+  color.color = rc;
+  color.pixel = 1;
+  draw_text_core(drw, mask, NULL, None, DRAW_TARGET_ALPHA8, &color, x, y, w, h, 0, text, 0, 0);
+}
+
+static int render_blend_op(int mode) {
+  switch (mode) {
+  case BG_MODE_INVERT:
+    return PictOpDifference;
+  case BG_MODE_MULTIPLY:
+    return PictOpMultiply;
+  case BG_MODE_SCREEN:
+    return PictOpScreen;
+  case BG_MODE_OVERLAY:
+    return PictOpOverlay;
+  case BG_MODE_DARKEN:
+    return PictOpDarken;
+  case BG_MODE_LIGHTEN:
+    return PictOpLighten;
+  default:
+    return PictOpOver;
+  }
+}
+
+static int client_blend_op(int mode) {
+  switch (mode) {
+  case BG_MODE_INVERT:
+    return BlendDifference;
+  case BG_MODE_MULTIPLY:
+    return BlendMultiply;
+  case BG_MODE_SCREEN:
+    return BlendScreen;
+  case BG_MODE_OVERLAY:
+    return BlendOverlay;
+  case BG_MODE_DARKEN:
+    return BlendDarken;
+  case BG_MODE_LIGHTEN:
+  default:
+    return BlendLighten;
+  }
+}
+
+/* Client-side blending over MIT-SHM: the wallpaper under each clock block is
+ * pulled once into a shared image and blended with each text colour as if
+ * fully covered. A tick then only steps between those two tiles by glyph
+ * coverage and sends the result back with XShmPutImage. Used where RENDER
+ * lacks the PDF blend ops or runs them slower than we can (see blend_probe). */
+typedef struct {
+  XImage *img;
+  XShmSegmentInfo seg;
+} ShmImage;
+
+typedef struct {
+  int op;
+  uint32_t fg;
+  unsigned int alpha;
+  uint32_t *px; /* w x h, the block's wallpaper under full coverage */
+} BlendTile;
+
+typedef struct {
+  unsigned long gen; /* wallpaper_gen the pixels were read at */
+  int x, y;
+  unsigned int w, h;
+  unsigned long used;
+  ShmImage bg;
+  BlendTile tiles[BLEND_TILES];
+  int next_tile;
+} ShmBlock;
+
+static struct {
+  int enabled;
+  const char *isa; /* kernels blend_init picked */
+  ShmBlock blocks[MAX_MONITORS];
+  ShmImage out;       /* blended lines, stacked top to bottom within a frame */
+  unsigned int out_y; /* first free row of out */
+  int inflight;       /* the server may still be reading out */
+  unsigned char *cov;
+  size_t cov_size;
+  unsigned long frame;
+} shm;
+
+static int shm_error;
+
+static int shm_error_handler(Display *dpy, XErrorEvent *ee) {
+  (void)dpy;
+  (void)ee;
+  shm_error = 1;
+  return 0;
+}
+
+static void shm_image_free(Display *dpy, ShmImage *si) {
+  if (!si->img)
+    return;
+  XShmDetach(dpy, &si->seg);
+  XDestroyImage(si->img);
+  shmdt(si->seg.shmaddr);
+  memset(si, 0, sizeof *si);
+}
+
+static int shm_image_create(Display *dpy, int screen, ShmImage *si, unsigned int w,
+                            unsigned int h) {
+  memset(si, 0, sizeof *si);
+  si->img = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen), ZPixmap,
+                            NULL, &si->seg, w, h);
+  if (!si->img)
+    return 0;
+  if (si->img->bits_per_pixel != 32 ||
+      (si->seg.shmid = shmget(IPC_PRIVATE, (size_t)si->img->bytes_per_line * h,
+                              IPC_CREAT | 0600)) < 0) {
+    XDestroyImage(si->img);
+    si->img = NULL;
+    return 0;
+  }
+  si->seg.shmaddr = si->img->data = shmat(si->seg.shmid, NULL, 0);
+  si->seg.readOnly = False;
+
+  /* attaching fails asynchronously when the server cannot share our memory */
+  int (*prev)(Display *, XErrorEvent *) = XSetErrorHandler(shm_error_handler);
+  shm_error = 0;
+  if (si->seg.shmaddr != (char *)-1)
+    XShmAttach(dpy, &si->seg);
+  XSync(dpy, False);
+  stats_roundtrip();
+  XSetErrorHandler(prev);
+  shmctl(si->seg.shmid, IPC_RMID, NULL);
+  if (si->seg.shmaddr == (char *)-1 || shm_error) {
+    if (si->seg.shmaddr != (char *)-1)
+      shmdt(si->seg.shmaddr);
+    si->img->data = NULL;
+    XDestroyImage(si->img);
+    memset(si, 0, sizeof *si);
+    return 0;
+  }
+  return 1;
+}
+
+static void shm_block_free(Display *dpy, ShmBlock *b) {
+  shm_image_free(dpy, &b->bg);
+  for (int i = 0; i < BLEND_TILES; i++)
+    free(b->tiles[i].px);
+  memset(b, 0, sizeof *b);
+}
+
+static void shm_free(Display *dpy) {
+  for (int i = 0; i < MAX_MONITORS; i++)
+    shm_block_free(dpy, &shm.blocks[i]);
+  shm_image_free(dpy, &shm.out);
+  free(shm.cov);
+  memset(&shm, 0, sizeof shm);
+}
+
+/* Called before rendering: out is reused from the top once the server is
+ * known to be done with last frame's puts. Puts of the current frame are
+ * not behind a fence yet and need one of their own. */
+static void shm_frame_begin(Display *dpy) {
+  shm.frame++;
+  if (shm.inflight)
+    fence_submit(dpy);
+  fence_wait(dpy);
+  shm.inflight = 0;
+  shm.out_y = 0;
+}
+
+/* Wallpaper pixels under the block at x,y, read at most once per wallpaper */
+static ShmBlock *shm_block(Drw *drw, int x, int y, unsigned int w, unsigned int h) {
+  ShmBlock *b = NULL, *victim = &shm.blocks[0];
+  for (int i = 0; i < MAX_MONITORS && !b; i++) {
+    ShmBlock *c = &shm.blocks[i];
+    if (c->bg.img && c->gen == wallpaper_gen && c->x == x && c->y == y && c->w == w && c->h == h)
+      b = c;
+    else if (c->used < victim->used)
+      victim = c;
+  }
+  if (!b) {
+    Window r;
+    int px, py;
+    unsigned int pw, ph, pb, pd;
+    /* the crop has to lie within the wallpaper pixmap for XShmGetImage */
+    stats_roundtrip();
+    if (!XGetGeometry(drw->dpy, wallpaper_cached, &r, &px, &py, &pw, &ph, &pb, &pd) || x < 0 ||
+        y < 0 || x + w > pw || y + h > ph)
+      return NULL;
+    b = victim;
+    shm_block_free(drw->dpy, b);
+    if (!shm_image_create(drw->dpy, drw->screen, &b->bg, w, h))
+      return NULL;
+    XShmGetImage(drw->dpy, wallpaper_cached, b->bg.img, x, y, AllPlanes);
+    stats_roundtrip();
+    b->gen = wallpaper_gen;
+    b->x = x;
+    b->y = y;
+    b->w = w;
+    b->h = h;
+  }
+  b->used = shm.frame;
+  return b;
+}
+
+/* The block blended with fg at alpha everywhere, built once per wallpaper */
+static const uint32_t *shm_tile(ShmBlock *b, int op, uint32_t fg, unsigned int alpha) {
+  BlendTile *t;
+  for (int i = 0; i < BLEND_TILES; i++) {
+    t = &b->tiles[i];
+    if (t->px && t->op == op && t->fg == fg && t->alpha == alpha)
+      return t->px;
+  }
+  t = &b->tiles[b->next_tile];
+  b->next_tile = (b->next_tile + 1) % BLEND_TILES;
+  if (!t->px)
+    t->px = ecalloc((size_t)b->w * b->h, sizeof *t->px);
+  for (unsigned int row = 0; row < b->h; row++)
+    blend_tile(op, t->px + (size_t)row * b->w,
+               (const uint32_t *)(b->bg.img->data + (size_t)row * b->bg.img->bytes_per_line), fg,
+               alpha, b->w);
+  t->op = op;
+  t->fg = fg;
+  t->alpha = alpha;
+  return t->px;
+}
+
+/* Coverage of text rendered at 0,0 into shm.cov (w x h) */
+static int shm_coverage(Drw *drw, Fnt *font, const char *text, unsigned int w, unsigned int h) {
+  size_t size = (size_t)w * h;
+  if (size > shm.cov_size) {
+    free(shm.cov);
+    shm.cov = ecalloc(1, size);
+    shm.cov_size = size;
+  }
+  if (atlas_coverage(font, text, shm.cov, (int)w, (int)h))
+    return 1;
+
+  /* not in the atlas: rasterise on the server and read the mask back */
+  Picture mask_pic;
+  Pixmap mask = rcache_mask(drw, w, h, &mask_pic);
+  if (!mask)
+    return 0;
+  Fnt *prev_font = drw->fonts;
+  drw_setfontset(drw, font);
+  draw_text_mask(drw, mask, mask_pic, 0, 0, w, h, text);
+  drw_setfontset(drw, prev_font);
+  XImage *img = XGetImage(drw->dpy, mask, 0, 0, w, h, AllPlanes, ZPixmap);
+  stats_roundtrip();
+  if (!img)
+    return 0;
+  for (unsigned int row = 0; row < h; row++)
+    memcpy(shm.cov + (size_t)row * w, img->data + (size_t)row * img->bytes_per_line, w);
+  XDestroyImage(img);
+  return 1;
+}
+
+static int shm_blend_text(Drw *drw, const BlockLayout *lay, int mode, int x, int y,
+                          unsigned int w, unsigned int h, const char *text, Fnt *font,
+                          const Clr *fg_clr) {
+  /* the client blend writes 24-bit pixels */
+  if (!shm.enabled || wallpaper_cached == None || (draw_buf && draw_buf->argb))
+    return 0;
+
+  /* only the part inside the repaint clip is blended and sent */
+  int cx0 = x, cy0 = y, cx1 = x + (int)w, cy1 = y + (int)h;
+  if (draw_clip) {
+    cx0 = MAX(cx0, draw_clip->x);
+    cy0 = MAX(cy0, draw_clip->y);
+    cx1 = MIN(cx1, draw_clip->x + draw_clip->width);
+    cy1 = MIN(cy1, draw_clip->y + draw_clip->height);
+  }
+  if (cx1 <= cx0 || cy1 <= cy0)
+    return 1;
+  unsigned int cw = (unsigned int)(cx1 - cx0), ch = (unsigned int)(cy1 - cy0);
+
+  if (x < lay->bx || y < lay->by || x + (int)w > lay->bx + (int)lay->bw ||
+      y + (int)h > lay->by + (int)lay->bh)
+    return 0;
+  ShmBlock *b = shm_block(drw, lay->bx + draw_org_x, lay->by + draw_org_y, lay->bw, lay->bh);
+  if (!b || !shm_coverage(drw, font, text, w, h))
+    return 0;
+
+  if (!shm.out.img || shm.out.img->width < (int)cw || shm.out.img->height < (int)ch ||
+      shm.out_y + ch > (unsigned int)shm.out.img->height) {
+    shm_frame_begin(drw->dpy);
+    if (!shm.out.img || shm.out.img->width < (int)cw || shm.out.img->height < (int)ch) {
+      unsigned int ow = shm.out.img ? MAX((unsigned int)shm.out.img->width, cw) : cw;
+      unsigned int oh = shm.out.img ? MAX((unsigned int)shm.out.img->height, ch * 2) : ch * 2;
+      shm_image_free(drw->dpy, &shm.out);
+      if (!shm_image_create(drw->dpy, drw->screen, &shm.out, ow, oh))
+        return 0;
+    }
+  }
+
+  uint32_t fg = (uint32_t)(fg_clr->color.red >> 8) << 16 |
+                (uint32_t)(fg_clr->color.green >> 8) << 8 | (fg_clr->color.blue >> 8);
+  const uint32_t *tile = shm_tile(b, client_blend_op(mode), fg, fg_clr->color.alpha >> 8);
+  XImage *out = shm.out.img, *bg = b->bg.img;
+  for (unsigned int row = 0; row < ch; row++) {
+    size_t by = (size_t)(cy0 + draw_org_y - b->y) + row, bx = (size_t)(cx0 + draw_org_x - b->x);
+    blend_lerp((uint32_t *)(out->data + (size_t)(shm.out_y + row) * out->bytes_per_line),
+               (const uint32_t *)(bg->data + by * bg->bytes_per_line) + bx,
+               tile + by * b->w + bx, shm.cov + (size_t)(cy0 - y + (int)row) * w + (cx0 - x),
+               cw);
+  }
+  XShmPutImage(drw->dpy, drw->drawable, drw->gc, out, 0, (int)shm.out_y, cx0, cy0, cw, ch, False);
+  stats_pixels(cw, ch);
+  shm.out_y += ch;
+  shm.inflight = 1;
+  return 1;
+}
+
+static double probe_elapsed(const struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (double)(t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Decides at startup whether blend modes go through RENDER or MIT-SHM. With
+ * BLEND_BACKEND_AUTO the client path wins when RENDER is older than 0.11 (no
+ * PDF blend ops) or when blending a clock-sized area takes the server longer
+ * than blending and uploading it takes us. */
+static int blend_probe(Drw *drw) {
+  Display *dpy = drw->dpy;
+  Visual *vis = DefaultVisual(dpy, drw->screen);
+  int major, minor;
+  Bool pixmaps;
+
+  if (blend_backend == BLEND_BACKEND_RENDER || !is_blend_mode(bg_mode))
+    return 0;
+  if (!XShmQueryVersion(dpy, &major, &minor, &pixmaps) || vis->class != TrueColor ||
+      vis->red_mask != 0xff0000 || vis->green_mask != 0xff00 || vis->blue_mask != 0xff)
+    return 0;
+  if (!shm_image_create(dpy, drw->screen, &shm.out, BLEND_PROBE_W, BLEND_PROBE_H))
+    return 0;
+  if (blend_backend == BLEND_BACKEND_SHM)
+    return 1;
+  if (!XRenderQueryVersion(dpy, &major, &minor) || (major == 0 && minor < 11))
+    return 1;
+
+  XRenderPictFormat *fmt = XRenderFindVisualFormat(dpy, vis);
+  Picture mask_pic;
+  if (!fmt || !rcache_mask(drw, BLEND_PROBE_W, BLEND_PROBE_H, &mask_pic))
+    return 0;
+  XRenderColor half = {0, 0, 0, 0x8000}, fg = {0xffff, 0x8000, 0x4000, 0xffff};
+  XRenderFillRectangle(dpy, PictOpSrc, mask_pic, &half, 0, 0, BLEND_PROBE_W, BLEND_PROBE_H);
+  Pixmap pm = XCreatePixmap(dpy, drw->root, BLEND_PROBE_W, BLEND_PROBE_H,
+                            DefaultDepth(dpy, drw->screen));
+  Picture pic = XRenderCreatePicture(dpy, pm, fmt, 0, NULL);
+  Picture src = rcache_fill(dpy, &fg);
+  GC gc = XCreateGC(dpy, pm, 0, NULL);
+  struct timespec t0;
+
+  XSync(dpy, False);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < BLEND_PROBE_RUNS; i++) {
+    XRenderComposite(dpy, render_blend_op(bg_mode), src, mask_pic, pic, 0, 0, 0, 0, 0, 0,
+                     BLEND_PROBE_W, BLEND_PROBE_H);
+    XSync(dpy, False);
+  }
+  double t_render = probe_elapsed(&t0);
+
+  /* the per-tick client work: one coverage step between two tiles */
+  unsigned char cov[BLEND_PROBE_W];
+  uint32_t tile[BLEND_PROBE_W];
+  memset(cov, 0x80, sizeof cov);
+  memset(shm.out.img->data, 0x40, (size_t)shm.out.img->bytes_per_line * BLEND_PROBE_H);
+  blend_tile(client_blend_op(bg_mode), tile, (const uint32_t *)shm.out.img->data, 0xff8040, 0xff,
+             BLEND_PROBE_W);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < BLEND_PROBE_RUNS; i++) {
+    for (int row = 0; row < BLEND_PROBE_H; row++) {
+      uint32_t *px = (uint32_t *)(shm.out.img->data + (size_t)row * shm.out.img->bytes_per_line);
+      blend_lerp(px, px, tile, cov, BLEND_PROBE_W);
+    }
+    XShmPutImage(dpy, pm, gc, shm.out.img, 0, 0, 0, 0, BLEND_PROBE_W, BLEND_PROBE_H, False);
+    XSync(dpy, False);
+  }
+  double t_client = probe_elapsed(&t0);
+
+  XFreeGC(dpy, gc);
+  XRenderFreePicture(dpy, pic);
+  XFreePixmap(dpy, pm);
+  return t_client < t_render;
+}
+
+static int apply_effect_for_text(Drw *drw, const BlockLayout *lay, int mode, int text_x,
+                                 int text_y, unsigned int text_w, unsigned int text_h,
+                                 const char *text, Fnt *font, const Clr *fg_clr) {
+  if (!text || !*text || text_w == 0 || text_h == 0 || !drw || !font || !is_blend_mode(mode))
+    return 0;
+
+  if (shm_blend_text(drw, lay, mode, text_x, text_y, text_w, text_h, text, font, fg_clr))
+    return 1;
+
+  Display *dpy = drw->dpy;
+  Picture mask_pic;
+  Pixmap mask = rcache_mask(drw, text_w, text_h, &mask_pic);
+  if (!mask)
+    return 0;
+
+  Fnt *prev_font = drw->fonts;
+  drw_setfontset(drw, font);
+  draw_text_mask(drw, mask, mask_pic, 0, 0, text_w, text_h, text);
+  drw_setfontset(drw, prev_font);
+
+  Picture dst = rcache_dst(drw);
+  if (dst == None)
+    return 0;
+
+  XRenderColor rc = clr_to_xrender(fg_clr);
+  XRenderComposite(dpy, render_blend_op(mode), rcache_fill(dpy, &rc), mask_pic, dst, 0, 0, 0, 0,
+                   text_x, text_y, text_w, text_h);
+  return 1;
+}
+
+/* Advance widths per codepoint for one fontset, so measuring a line is a sum
+ * of table lookups instead of an Xft walk. Filled at startup with every
+ * codepoint the format can produce, and on demand for anything else. */
+typedef struct {
+  Fnt *set;
+  struct {
+    long cp; /* 0 marks a free slot */
+    unsigned int adv;
+  } slot[ADV_CACHE_SIZE];
+  int n;
+  int tabular; /* 0-9 share one advance, so digits never change a width */
+} AdvanceCache;
+
+static AdvanceCache time_adv, date_adv;
+
+static AdvanceCache *adv_for(Fnt *set) {
+  if (set && time_adv.set == set)
+    return &time_adv;
+  if (set && date_adv.set == set)
+    return &date_adv;
+  return NULL;
+}
+
+/* Slot holding cp, or the free slot it would go into */
+static unsigned int adv_slot(const AdvanceCache *c, long cp) {
+  unsigned int i = ((unsigned int)cp * 2654435761u) & (ADV_CACHE_SIZE - 1);
+  while (c->slot[i].cp != 0 && c->slot[i].cp != cp)
+    i = (i + 1) & (ADV_CACHE_SIZE - 1);
+  return i;
+}
+
+static void adv_insert(AdvanceCache *c, long cp, unsigned int adv) {
+  unsigned int i = adv_slot(c, cp);
+  if (c->slot[i].cp != cp && c->n >= ADV_CACHE_SIZE * 3 / 4)
+    return;
+  if (c->slot[i].cp != cp)
+    c->n++;
+  c->slot[i].cp = cp;
+  c->slot[i].adv = adv;
+}
+
+static unsigned int adv_lookup(Drw *drw, AdvanceCache *c, long cp) {
+  unsigned int i = adv_slot(c, cp);
+  if (c->slot[i].cp == cp)
+    return c->slot[i].adv;
+
+  /* measuring also discovers and appends a fallback font when needed */
+  char utf8[8] = {0};
+  FcUcs4ToUtf8((FcChar32)cp, (FcChar8 *)utf8);
+  drw_setfontset(drw, c->set);
+  unsigned int adv = drw_fontset_getwidth(drw, utf8);
+  adv_insert(c, cp, adv);
+  return adv;
+}
+
+/* With cs the advances are taken from the font cache instead of measured */
+static void adv_build(Drw *drw, AdvanceCache *c, Fnt *set, const char *fmt, const FcacheSet *cs) {
+  long cps[ATLAS_MAX_GLYPHS];
+  Fnt *prev_font = drw->fonts;
+
+  memset(c, 0, sizeof *c);
+  if (!set || !fmt)
+    return;
+  c->set = set;
+  if (cs) {
+    for (unsigned int i = 0; i < cs->nglyphs; i++)
+      adv_insert(c, cs->glyphs[i].cp, cs->glyphs[i].adv);
+  } else {
+    int ncp = atlas_collect(fmt, cps, LENGTH(cps));
+    for (int i = 0; i < ncp; i++)
+      adv_lookup(drw, c, cps[i]);
+  }
+  c->tabular = 1;
+  for (long d = '1'; d <= '9'; d++)
+    c->tabular &= adv_lookup(drw, c, d) == adv_lookup(drw, c, '0');
+  drw_setfontset(drw, prev_font);
+}
+
+/* Whether a and b are sure to measure the same in set: equal apart from
+ * digits, when the digits are tabular */
+static int width_class_equal(Fnt *set, const char *a, const char *b) {
+  const AdvanceCache *c = adv_for(set);
+  if (!c || !c->tabular)
+    return strcmp(a, b) == 0;
+  for (; *a && *b; a++, b++) {
+    int da = *a >= '0' && *a <= '9', db = *b >= '0' && *b <= '9';
+    if (da != db || (!da && *a != *b))
+      return 0;
+  }
+  return *a == *b;
+}
+
+static unsigned int text_width(Drw *drw, Fnt *set, const char *text) {
+  AdvanceCache *c = adv_for(set);
+  if (c) {
+    unsigned int w = 0;
+    int err = 0;
+    long cp;
+    const char *p = text;
+    while (*p) {
+      p += utf8decode(p, &cp, &err);
+      if (err)
+        break;
+      w += adv_lookup(drw, c, cp);
+    }
+    if (!*p && !err)
+      return w;
+  }
+  drw_setfontset(drw, set);
+  return drw_fontset_getwidth(drw, text);
+}
+
+/* Everything that decides which fonts the configured names resolve to and
+ * how they measure: the names and formats, the locale the formats expand
+ * in, and the Xft resources and screen size that set the DPI */
+static unsigned long long font_cache_key(Display *dpy, int screen) {
+  const char *parts[LENGTH(time_fonts) + LENGTH(date_fonts) + 5];
+  char geom[64];
+  int n = 0;
+
+  for (size_t i = 0; i < LENGTH(time_fonts); i++)
+    parts[n++] = time_fonts[i];
+  for (size_t i = 0; i < LENGTH(date_fonts); i++)
+    parts[n++] = date_fonts[i];
+  parts[n++] = time_fmt;
+  parts[n++] = date_fmt;
+  parts[n++] = setlocale(LC_TIME, NULL);
+  parts[n++] = XResourceManagerString(dpy);
+  snprintf(geom, sizeof geom, "%dx%d %dx%dmm", DisplayWidth(dpy, screen),
+           DisplayHeight(dpy, screen), DisplayWidthMM(dpy, screen), DisplayHeightMM(dpy, screen));
+  parts[n++] = geom;
+  return fcache_key(parts, n);
+}
+
+static void font_cache_entry_free(FcacheSet *cs) {
+  for (unsigned int i = 0; i < cs->nfonts; i++) {
+    if (cs->fonts[i].resolved)
+      FcStrFree((FcChar8 *)cs->fonts[i].resolved);
+    if (cs->fonts[i].pattern)
+      FcStrFree((FcChar8 *)cs->fonts[i].pattern);
+  }
+  cs->nfonts = 0;
+}
+
+/* Records what startup resolved for set: its fonts as matched patterns and,
+ * for every codepoint fmt can produce, the covering font and advance */
+static int font_cache_entry(Drw *drw, FcacheSet *cs, FcacheGlyph *glyphs, Fnt *set,
+                            const char *fmt, AdvanceCache *c) {
+  long cps[ATLAS_MAX_GLYPHS];
+  int ncp = atlas_collect(fmt, cps, LENGTH(cps));
+
+  /* measure first: a miss may still append a fallback font to set */
+  for (int i = 0; i < ncp; i++) {
+    glyphs[i].cp = (int)cps[i];
+    glyphs[i].adv = adv_lookup(drw, c, cps[i]);
+  }
+  for (int i = 0; i < ncp; i++) {
+    int idx = 0;
+    Fnt *f = set;
+    while (f && !XftCharExists(drw->dpy, f->xfont, (FcChar32)cps[i])) {
+      f = f->next;
+      idx++;
+    }
+    glyphs[i].font = f ? idx : -1;
+  }
+  cs->glyphs = glyphs;
+  cs->nglyphs = (unsigned int)ncp;
+
+  for (Fnt *f = set; f; f = f->next) {
+    if (cs->nfonts == FCACHE_MAX_FONTS)
+      return 0;
+    FcacheFont *e = &cs->fonts[cs->nfonts++];
+    e->resolved = (const char *)FcNameUnparse(f->xfont->pattern);
+    e->pattern = (const char *)(f->pattern ? FcNameUnparse(f->pattern)
+                                           : FcStrCopy((const FcChar8 *)""));
+    if (!e->resolved || !e->pattern)
+      return 0;
+  }
+  return 1;
+}
+
+static void font_cache_save(Drw *drw, unsigned long long key, Fnt *tf, Fnt *df) {
+  static FcacheGlyph glyphs[2][ATLAS_MAX_GLYPHS];
+  FcacheSet sets[2];
+  Fnt *fonts[2] = {tf, df};
+  AdvanceCache *adv[2] = {&time_adv, &date_adv};
+  const char *fmts[2] = {time_fmt, date_fmt};
+  int nsets = df ? 2 : 1, ok = 1;
+  Fnt *prev_font = drw->fonts;
+
+  memset(sets, 0, sizeof sets);
+  for (int i = 0; i < nsets && ok; i++)
+    ok = font_cache_entry(drw, &sets[i], glyphs[i], fonts[i], fmts[i], adv[i]);
+  if (ok && fcache_store(key, sets, nsets) != 0)
+    fprintf(stderr, "rootclock: cannot write font cache\n");
+  for (int i = 0; i < nsets; i++)
+    font_cache_entry_free(&sets[i]);
+  drw_setfontset(drw, prev_font);
+}
+
+static int layout_equal(const BlockLayout *a, const BlockLayout *b) {
+  return a->rx == b->rx && a->ry == b->ry && a->rw == b->rw && a->rh == b->rh &&
+         a->bx == b->bx && a->by == b->by && a->bw == b->bw && a->bh == b->bh && a->tx == b->tx &&
+         a->time_top == b->time_top && a->tw == b->tw &&
+         a->time_h == b->time_h && a->has_date == b->has_date && a->dx == b->dx &&
+         a->date_top == b->date_top && a->dw == b->dw && a->date_h == b->date_h;
+}
+
+/* Computes the box covering the glyph cells that differ between prev and cur
+ * on a line whose width did not change. The common prefix and suffix keep
+ * their advances, so only the span between them has to be repainted; it is
+ * widened a little to catch ink that overhangs its advance. */
+static int line_dirty_rect(Drw *drw, const BlockLayout *lay, Fnt *set, const char *prev,
+                           const char *cur, int x, int y, unsigned int w, unsigned int h,
+                           XRectangle *r) {
+  char buf[DATE_BUF_SIZE];
+  size_t n = strlen(cur), m = strlen(prev), pre = 0, suf = 0;
+
+  if (n == m && memcmp(cur, prev, n) == 0)
+    return 0;
+  while (pre < n && pre < m && cur[pre] == prev[pre])
+    pre++;
+  while (pre > 0 && (cur[pre] & 0xC0) == 0x80)
+    pre--;
+  while (suf < n - pre && suf < m - pre && cur[n - 1 - suf] == prev[m - 1 - suf])
+    suf++;
+  while (suf > 0 && (cur[n - suf] & 0xC0) == 0x80)
+    suf--;
+  if (pre >= sizeof buf)
+    pre = 0;
+
+  memcpy(buf, cur, pre);
+  buf[pre] = '\0';
+  unsigned int pw = pre ? text_width(drw, set, buf) : 0;
+  unsigned int sw = suf ? text_width(drw, set, cur + n - suf) : 0;
+  if (pw + sw > w)
+    pw = sw = 0;
+
+  int pad = (int)h / DIRTY_PAD_DIV;
+  int x0 = MAX(x + (int)pw - pad, lay->rx);
+  int x1 = MIN(x + (int)(w - sw) + pad, lay->rx + lay->rw);
+  int y0 = MAX(y, lay->ry);
+  int y1 = MIN(y + (int)h, lay->ry + lay->rh);
+  if (x1 <= x0 || y1 <= y0)
+    return 0;
+  r->x = (short)x0;
+  r->y = (short)y0;
+  r->width = (unsigned short)(x1 - x0);
+  r->height = (unsigned short)(y1 - y0);
+  return 1;
+}
+
+/* Bounding box of two padded clock blocks, clamped to the monitor of b */
+static int block_union(const BlockLayout *a, const BlockLayout *b, XRectangle *r) {
+  int x0 = MAX(MIN(a->bx, b->bx), b->rx);
+  int y0 = MAX(MIN(a->by, b->by), b->ry);
+  int x1 = MIN(MAX(a->bx + (int)a->bw, b->bx + (int)b->bw), b->rx + b->rw);
+  int y1 = MIN(MAX(a->by + (int)a->bh, b->by + (int)b->bh), b->ry + b->rh);
+  if (x1 <= x0 || y1 <= y0)
+    return 0;
+  r->x = (short)x0;
+  r->y = (short)y0;
+  r->width = (unsigned short)(x1 - x0);
+  r->height = (unsigned short)(y1 - y0);
+  return 1;
+}
+
+/* The box a line's layer covers in drw->drawable: the line widened like a
+ * dirty span for overhang, clamped to the block */
+static int line_box(const BlockLayout *lay, int x, int y, unsigned int w, unsigned int h,
+                    XRectangle *r) {
+  int pad = (int)h / DIRTY_PAD_DIV;
+  int x0 = MAX(x - pad, lay->bx);
+  int x1 = MIN(x + (int)w + pad, lay->bx + (int)lay->bw);
+  int y0 = MAX(y, lay->by);
+  int y1 = MIN(y + (int)h, lay->by + (int)lay->bh);
+  if (x1 <= x0 || y1 <= y0)
+    return 0;
+  r->x = (short)x0;
+  r->y = (short)y0;
+  r->width = (unsigned short)(x1 - x0);
+  r->height = (unsigned short)(y1 - y0);
+  return 1;
+}
+
+static int line_layer_match(const LineLayer *l, const XRectangle *box, Fnt *font, Clr *scm,
+                            const char *text, int fill_bg) {
+  /* a solid background looks the same anywhere, a wallpaper only in place */
+  if (!l->valid || l->w != box->width || l->h != box->height || l->font != font ||
+      l->scm != scm || l->fill_bg != fill_bg || l->bg != draw_bg || strcmp(l->text, text) != 0)
+    return 0;
+  if (draw_bg != None &&
+      (l->bg_gen != wallpaper_gen || l->x != box->x + draw_org_x || l->y != box->y + draw_org_y))
+    return 0;
+  return 1;
+}
+
+/* Keeps the line just drawn under box for later ticks */
+static void line_layer_store(Drw *drw, LineLayer *l, const XRectangle *box, Fnt *font, Clr *scm,
+                             const char *text, int fill_bg) {
+  l->valid = 0;
+  if (strlen(text) >= sizeof l->text)
+    return;
+  if (l->pm == None || l->pw < box->width || l->ph < box->height) {
+    if (l->pm != None)
+      XFreePixmap(drw->dpy, l->pm);
+    l->pw = MAX(l->pw, box->width);
+    l->ph = MAX(l->ph, box->height);
+    l->pm = XCreatePixmap(drw->dpy, drw->root, l->pw, l->ph, DefaultDepth(drw->dpy, drw->screen));
+  }
+  if (!layer_gc)
+    layer_gc = XCreateGC(drw->dpy, drw->root, 0, NULL);
+  XCopyArea(drw->dpy, drw->drawable, l->pm, layer_gc, box->x, box->y, box->width, box->height, 0,
+            0);
+  l->valid = 1;
+  l->x = box->x + draw_org_x;
+  l->y = box->y + draw_org_y;
+  l->w = box->width;
+  l->h = box->height;
+  l->font = font;
+  l->scm = scm;
+  l->bg = draw_bg;
+  l->bg_gen = wallpaper_gen;
+  l->fill_bg = fill_bg;
+  snprintf(l->text, sizeof l->text, "%s", text);
+}
+
+/* Draws one line over the background prepared under it: copied from its
+ * layer when nothing that shows in it changed, rendered (and kept, if
+ * drawn whole) otherwise */
+static void draw_line(Drw *drw, const BlockLayout *lay, LineLayer *l, Fnt *font, Clr *scm, int x,
+                      int y, unsigned int w, unsigned int h, const char *text, int fill_bg) {
+  XRectangle box;
+  int boxed = line_box(lay, x, y, w, h, &box);
+
+  if (boxed && draw_clip && !rect_intersects(draw_clip, &box))
+    return;
+  if (l && boxed && line_layer_match(l, &box, font, scm, text, fill_bg)) {
+    XCopyArea(drw->dpy, l->pm, drw->drawable, drw->gc, 0, 0, box.width, box.height, box.x, box.y);
+    stats_pixels(box.width, box.height);
+    return;
+  }
+
+  if (!is_blend_mode(bg_mode) || lay->bw == 0 || lay->bh == 0 ||
+      !apply_effect_for_text(drw, lay, bg_mode, x, y, w, h, text, font, &scm[ColFg])) {
+    drw_setfontset(drw, font);
+    drw_setscheme(drw, scm);
+    draw_text_custom(drw, x, y, w, h, 0, text, 0, fill_bg);
+  }
+  if (l && boxed && (!draw_clip || rect_contains(draw_clip, &box)))
+    line_layer_store(drw, l, &box, font, scm, text, fill_bg);
+}
+
+static void draw_block_text(Drw *drw, const BlockLayout *lay, Fnt *tf, Fnt *df, Clr *time_scm,
+                            Clr *date_scm, const char *tstr, const char *dstr, int fill_bg) {
+  LineLayer *tl = draw_layers ? &draw_layers[LayerTime] : NULL;
+  LineLayer *dl = draw_layers ? &draw_layers[LayerDate] : NULL;
+
+  draw_line(drw, lay, tl, tf, time_scm, lay->tx, lay->time_top, lay->tw, lay->time_h, tstr,
+            fill_bg);
+  if (lay->has_date)
+    draw_line(drw, lay, dl, df, date_scm, lay->dx, lay->date_top, lay->dw, lay->date_h, dstr,
+              fill_bg);
+}
+
+/* Grows b to at least w x h and binds it as drw->drawable with its 0,0 at
+ * x,y on the root window. Returns the drawable block_buf_unbind restores. */
+static Drawable block_buf_bind(Drw *drw, BlockBuf *b, int x, int y, unsigned int w,
+                               unsigned int h) {
+  if (b->pm == None || b->w < w || b->h < h || b->argb != argb.active) {
+    unsigned int bw = (MAX(w, b->w) + BLOCK_BUF_ALIGN - 1) & ~(BLOCK_BUF_ALIGN - 1U);
+    unsigned int bh = (MAX(h, b->h) + BLOCK_BUF_ALIGN - 1) & ~(BLOCK_BUF_ALIGN - 1U);
+    int depth = argb.active ? 32 : DefaultDepth(drw->dpy, drw->screen);
+    block_buf_free(drw->dpy, b);
+    b->pm = XCreatePixmap(drw->dpy, drw->root, bw, bh, (unsigned int)depth);
+    b->w = bw;
+    b->h = bh;
+    b->argb = argb.active;
+  }
+  Drawable prev = drw->drawable;
+  drw->drawable = b->pm;
+  draw_buf = b;
+  draw_org_x = x;
+  draw_org_y = y;
+  if (b->argb) {
+    /* drw->gc only fits drawables of the root depth */
+    draw_gc_prev = drw->gc;
+    drw->gc = argb.gc;
+    draw_dst = argb.win[b - block_bufs];
+  }
+  return prev;
+}
+
+static void block_buf_unbind(Drw *drw, Drawable prev) {
+  if (draw_buf && draw_buf->argb)
+    drw->gc = draw_gc_prev;
+  drw->drawable = prev;
+  draw_buf = NULL;
+  draw_dst = None;
+  draw_org_x = draw_org_y = 0;
+}
+
+static BlockLayout layout_shift(const BlockLayout *l, int ox, int oy) {
+  BlockLayout r = *l;
+  r.rx += ox;
+  r.ry += oy;
+  r.bx += ox;
+  r.by += oy;
+  r.tx += ox;
+  r.time_top += oy;
+  r.dx += ox;
+  r.date_top += oy;
+  return r;
+}
+
+/* Queues background for the parts of the old block the new one left */
+static void present_vacated(Drawable src, unsigned long pixel, const BlockLayout *old,
+                            const BlockLayout *cur) {
+  int ox0 = old->bx, oy0 = old->by, ox1 = ox0 + (int)old->bw, oy1 = oy0 + (int)old->bh;
+  int nx0 = cur->bx, ny0 = cur->by, nx1 = nx0 + (int)cur->bw, ny1 = ny0 + (int)cur->bh;
+  if (nx1 <= ox0 || nx0 >= ox1 || ny1 <= oy0 || ny0 >= oy1) {
+    present_background(src, pixel, ox0, oy0, ox1 - ox0, oy1 - oy0);
+    return;
+  }
+  int y0 = MAX(oy0, ny0), y1 = MIN(oy1, ny1);
+  present_background(src, pixel, ox0, oy0, ox1 - ox0, ny0 - oy0);
+  present_background(src, pixel, ox0, ny1, ox1 - ox0, oy1 - ny1);
+  present_background(src, pixel, ox0, y0, nx0 - ox0, y1 - y0);
+  present_background(src, pixel, nx1, y0, ox1 - nx1, y1 - y0);
+}
+
+/* Background of an ARGB block buffer: transparent, so the compositor shows
+ * its own wallpaper around the glyphs, except where a blend mode needs the
+ * wallpaper underneath to blend with */
+static int argb_background(Drw *drw, Drawable src_drawable, int x, int y, unsigned int w,
+                           unsigned int h) {
+  Picture dst = rcache_dst(drw);
+  if (dst == None)
+    return 0;
+  /* under a compositor the root window does not show the wallpaper */
+  if (!is_blend_mode(bg_mode) || src_drawable == None || src_drawable == drw->root) {
+    XRenderColor clear = {0, 0, 0, 0};
+    XRenderFillRectangle(drw->dpy, PictOpSrc, dst, &clear, x, y, w, h);
+    return 0;
+  }
+  if (argb.src == None || argb.src_drawable != src_drawable || argb.src_gen != wallpaper_gen) {
+    if (argb.src != None)
+      XRenderFreePicture(drw->dpy, argb.src);
+    argb.src = XRenderCreatePicture(
+        drw->dpy, src_drawable,
+        XRenderFindVisualFormat(drw->dpy, DefaultVisual(drw->dpy, drw->screen)), 0, NULL);
+    argb.src_drawable = src_drawable;
+    argb.src_gen = wallpaper_gen;
+  }
+  XRenderComposite(drw->dpy, PictOpSrc, argb.src, None, dst, x + draw_org_x, y + draw_org_y, 0,
+                   0, x, y, w, h);
+  stats_pixels(w, h);
+  return 0;
+}
+
+/* Repaints r only: background and text clipped to r, queued for presenting */
+static void repaint_rect(Drw *drw, XRectangle *r, Drawable src_drawable, Clr *bg_scm,
+                         const BlockLayout *lay, Fnt *tf, Fnt *df, Clr *time_scm, Clr *date_scm,
+                         const char *tstr, const char *dstr) {
+  set_draw_clip(drw, r);
+  int fill_bg = draw_buf && draw_buf->argb
+                    ? argb_background(drw, src_drawable, r->x, r->y, r->width, r->height)
+                    : prepare_background(drw, src_drawable, r->x, r->y, r->width, r->height,
+                                         bg_scm);
+  draw_block_text(drw, lay, tf, df, time_scm, date_scm, tstr, dstr, fill_bg);
+  present_add(drw->drawable, r->x, r->y, r->width, r->height);
+  set_draw_clip(drw, NULL);
+}
+
+static void draw_block_for_region(Drw *drw, int rx, int ry, int rw, int rh,
+                                  Fnt *tf, Fnt *df, int show_date_flag, Clr *bg_scm, Clr *time_scm,
+                                  Clr *date_scm, const char *tstr, const char *dstr, int block_yoff,
+                                  int spacing, Pixmap wallpaper_pm, MonState *st) {
+  if (show_date_flag && (!df || !date_scm || !dstr)) {
+    fprintf(stderr, "rootclock: invalid parameters for date display\n");
+    return;
+  }
+
+  int time_h = tf->h;
+  if (!tf->xfont) {
+    fprintf(stderr, "rootclock: invalid font configuration\n");
+    return;
+  }
+  int ascent_t = tf->xfont->ascent;
+
+  int date_h = 0;
+  if (show_date_flag && df) {
     date_h = df->h;
   }
 
   int total_h = time_h + (show_date_flag ? (spacing + date_h) : 0);
   int base_y = ry + (rh - total_h) / 2 + ascent_t + block_yoff;
 
-  drw_setfontset(drw, tf);
-  unsigned int tw = drw_fontset_getwidth(drw, tstr);
+  /* a line of the same width class as last frame keeps its width, and with
+   * it the whole layout */
+  int reuse = st && st->valid;
+  unsigned int tw =
+      reuse && width_class_equal(tf, st->tstr, tstr) ? st->layout.tw : text_width(drw, tf, tstr);
 
   unsigned int dw = 0;
   int date_top = 0;
   int has_date = show_date_flag && df && dstr && *dstr;
   if (has_date) {
-    drw_setfontset(drw, df);
-    dw = drw_fontset_getwidth(drw, dstr);
+    dw = reuse && st->layout.has_date && width_class_equal(df, st->dstr, dstr)
+             ? st->layout.dw
+             : text_width(drw, df, dstr);
     date_top = base_y + (tf->h - ascent_t) + spacing;
   }
   drw_setfontset(drw, tf);
@@ -672,11 +2869,11 @@ static void draw_block_for_region(Drw *drw, Window target_win, int rx, int ry, i
       bottom_with_padding > block_y ? (unsigned int)(bottom_with_padding - block_y) : 0;
 
   Drawable src_drawable = 0;
-  if (background_mode != BG_MODE_SOLID) {
+  if (bg_mode != BG_MODE_SOLID) {
     if (wallpaper_pm != None) {
       src_drawable = wallpaper_pm;
-    } else if (background_mode == BG_MODE_COPY || is_blend_mode(background_mode)) {
-      src_drawable = drw->root;
+    } else if (bg_mode == BG_MODE_COPY || is_blend_mode(bg_mode)) {
+      src_drawable = bgcache.pm != None ? bgcache.pm : drw->root;
     } else if (!warned_no_wallpaper_pixmap) {
       fprintf(stderr, "rootclock: wallpaper pixmap not available; falling back to "
                       "solid background\n");
@@ -684,54 +2881,256 @@ static void draw_block_for_region(Drw *drw, Window target_win, int rx, int ry, i
     }
   }
 
-  int fill_bg =
-      prepare_background(drw, src_drawable, rx, ry, (unsigned int)rw, (unsigned int)rh, bg_scm);
+  BlockLayout lay;
+  memset(&lay, 0, sizeof lay);
+  lay.rx = rx;
+  lay.ry = ry;
+  lay.rw = rw;
+  lay.rh = rh;
+  lay.bx = block_x;
+  lay.by = block_y;
+  lay.bw = block_w;
+  lay.bh = block_h;
+  lay.tw = tw;
+  lay.time_h = (unsigned int)time_h;
+  lay.time_top = time_top;
+  lay.tx = block_x + ((int)block_w - (int)tw) / 2;
+  if (lay.tx < rx)
+    lay.tx = rx;
+  lay.has_date = has_date;
+  if (has_date) {
+    lay.dw = dw;
+    lay.date_h = (unsigned int)date_h;
+    lay.date_top = date_top;
+    lay.dx = block_x + ((int)block_w - (int)dw) / 2;
+    if (lay.dx < rx)
+      lay.dx = rx;
+  }
 
-  drw_setfontset(drw, tf);
-  drw_setscheme(drw, time_scm);
-  int tx = block_x + ((int)block_w - (int)tw) / 2;
-  if (tx < rx)
-    tx = rx;
+  /* layers need a background that does not contain the clock itself, and
+   * lines that do not overlap one another's snapshot */
+  draw_layers = NULL;
+  draw_bg = src_drawable;
+  if (use_line_layers && st && !argb.active && src_drawable != drw->root &&
+      (!has_date || date_top >= time_top + time_h || time_top >= date_top + date_h))
+    draw_layers = line_layers[st - mon_state];
+
+  XRectangle dirty[3];
+  int ndirty = 0;
+  int full = !st || !st->valid || st->wallpaper != wallpaper_pm || st->layout.rx != rx ||
+             st->layout.ry != ry || st->layout.rw != rw || st->layout.rh != rh;
+  int moved = !full && !layout_equal(&st->layout, &lay);
+  if (!full && !moved) {
+    if (line_dirty_rect(drw, &lay, tf, st->tstr, tstr, lay.tx, lay.time_top, tw, lay.time_h,
+                        &dirty[ndirty]))
+      ndirty++;
+    if (has_date && line_dirty_rect(drw, &lay, df, st->dstr, dstr, lay.dx, lay.date_top, dw,
+                                    lay.date_h, &dirty[ndirty]))
+      ndirty++;
+    if (st->refresh.width > 0 && st->refresh.height > 0)
+      dirty[ndirty++] = st->refresh;
+  }
 
-  int dx = 0;
-  if (has_date) {
-    dx = block_x + ((int)block_w - (int)dw) / 2;
-    if (dx < rx)
-      dx = rx;
-  }
-
-  int skip_text_draw = 0;
-  if (is_blend_mode(background_mode) && block_w > 0 && block_h > 0) {
-    int time_done = apply_effect_for_text(drw, background_mode, tx, time_top, tw, time_h, tstr, tf,
-                                          &time_scm[ColFg]);
-    int date_done = 1;
-    if (has_date) {
-      date_done = apply_effect_for_text(drw, background_mode, dx, date_top, dw, date_h, dstr, df,
-                                        &date_scm[ColFg]);
+  if ((buffer_mode == BUFFER_BLOCK || argb.active) && st) {
+    /* only the block is buffered: the rest of the region and whatever the
+     * block no longer covers get their background straight on the window,
+     * or, with ARGB windows, the window just follows the block */
+    if (argb.active) {
+      if ((full || moved) && lay.bw > 0 && lay.bh > 0) {
+        XRectangle g = {(short)lay.bx, (short)lay.by, (unsigned short)lay.bw,
+                        (unsigned short)lay.bh};
+        argb_place(drw->dpy, drw->root, (int)(st - mon_state), &g);
+      }
+    } else if (full) {
+      present_background(src_drawable, bg_scm[ColFg].pixel, rx, ry, rw, rh);
+    } else if (moved) {
+      present_vacated(src_drawable, bg_scm[ColFg].pixel, &st->layout, &lay);
+    }
+    if (full || moved) {
+      dirty[0].x = (short)lay.bx;
+      dirty[0].y = (short)lay.by;
+      dirty[0].width = (unsigned short)lay.bw;
+      dirty[0].height = (unsigned short)lay.bh;
+      ndirty = 1;
     }
-    if (time_done && date_done)
-      skip_text_draw = 1;
+    if (ndirty > 0 && lay.bw > 0 && lay.bh > 0) {
+      BlockLayout local = layout_shift(&lay, -lay.bx, -lay.by);
+      Drawable prev =
+          block_buf_bind(drw, &block_bufs[st - mon_state], lay.bx, lay.by, lay.bw, lay.bh);
+      for (int i = 0; i < ndirty; i++) {
+        dirty[i].x = (short)(dirty[i].x - lay.bx);
+        dirty[i].y = (short)(dirty[i].y - lay.by);
+        repaint_rect(drw, &dirty[i], src_drawable, bg_scm, &local, tf, df, time_scm, date_scm,
+                     tstr, dstr);
+      }
+      block_buf_unbind(drw, prev);
+    }
+  } else {
+    if (full) {
+      /* new monitor geometry or wallpaper: the whole region gets its
+       * background once, later ticks only touch the clock block */
+      int fill_bg = prepare_background(drw, src_drawable, rx, ry, (unsigned int)rw,
+                                       (unsigned int)rh, bg_scm);
+      draw_block_text(drw, &lay, tf, df, time_scm, date_scm, tstr, dstr, fill_bg);
+      present_add(drw->drawable, rx, ry, rw, rh);
+    } else if (moved && block_union(&st->layout, &lay, &dirty[0])) {
+      /* the block moved or resized: repaint what the old and new block cover */
+      ndirty = 1;
+    }
+    for (int i = 0; i < ndirty; i++)
+      repaint_rect(drw, &dirty[i], src_drawable, bg_scm, &lay, tf, df, time_scm, date_scm, tstr,
+                   dstr);
   }
+  draw_layers = NULL;
+  if (st) {
+    st->valid = 1;
+    st->wallpaper = wallpaper_pm;
+    st->layout = lay;
+    snprintf(st->tstr, sizeof st->tstr, "%s", tstr);
+    snprintf(st->dstr, sizeof st->dstr, "%s", has_date ? dstr : "");
+    memset(&st->refresh, 0, sizeof st->refresh);
+  }
+}
 
-  if (!skip_text_draw) {
-    drw_setscheme(drw, time_scm);
-    draw_text_custom(drw, tx, time_top, tw, time_h, 0, tstr, 0, fill_bg);
+/* Hash of the pixels of src under x,y,w,h, or 0 if they cannot be read */
+static unsigned long long crop_hash(Display *dpy, Drawable src, int x, int y, int w, int h) {
+  unsigned long long hash = 14695981039346656037ULL;
+
+  for (int y0 = 0; y0 < h; y0 += CROP_HASH_ROWS) {
+    int rows = MIN(CROP_HASH_ROWS, h - y0);
+    XImage *img =
+        XGetImage(dpy, src, x, y + y0, (unsigned int)w, (unsigned int)rows, AllPlanes, ZPixmap);
+    stats_roundtrip();
+    if (!img)
+      return 0;
+    if (img->bits_per_pixel != 32) {
+      XDestroyImage(img);
+      return 0;
+    }
+    for (int row = 0; row < rows; row++) {
+      const uint32_t *px = (const uint32_t *)(img->data + (size_t)row * img->bytes_per_line);
+      for (int i = 0; i < w; i++)
+        hash = (hash ^ (px[i] & invert_xor_mask)) * 1099511628211ULL;
+    }
+    XDestroyImage(img);
+  }
+  return hash ? hash : 1;
+}
 
-    if (has_date) {
-      drw_setfontset(drw, df);
-      drw_setscheme(drw, date_scm);
-      draw_text_custom(drw, dx, date_top, dw, date_h, 0, dstr, 0, fill_bg);
+/* Assigns every monitor the first earlier one with the same size, block and
+ * background. Only updates inside the block are ever shared, so only the
+ * wallpaper under it is hashed, once per wallpaper and block position. */
+static void mon_group_update(Display *dpy, Pixmap wallpaper_pm) {
+  unsigned int pw = 0, ph = 0;
+  int have_geom = 0;
+  XRectangle blocks[MAX_MONITORS];
+  int has_block[MAX_MONITORS];
+
+  for (int i = 0; i < cached_monitor_count; i++)
+    has_block[i] = mon_block(i, &blocks[i]);
+  for (int i = 0; i < cached_monitor_count; i++) {
+    const MonRect *m = &cached_monitors[i];
+    MonGroup *g = &mon_group[i];
+    g->leader = i;
+    for (int j = 0; j < i && g->leader == i; j++) {
+      const MonRect *o = &cached_monitors[j];
+      if (mon_group[j].leader != j || o->w != m->w || o->h != m->h)
+        continue;
+      if (bg_mode == BG_MODE_SOLID) {
+        g->leader = j;
+        continue;
+      }
+      /* the root window as source includes our own drawing: never shared */
+      if (wallpaper_pm == None)
+        break;
+      /* the same block, relative to the monitor, in both */
+      if (!has_block[i] || !has_block[j] || blocks[j].x - o->x != blocks[i].x - m->x ||
+          blocks[j].y - o->y != blocks[i].y - m->y || blocks[j].width != blocks[i].width ||
+          blocks[j].height != blocks[i].height)
+        continue;
+      if (!have_geom) {
+        Window r;
+        int px, py;
+        unsigned int pb, pd;
+        if (!XGetGeometry(dpy, wallpaper_pm, &r, &px, &py, &pw, &ph, &pb, &pd))
+          pw = ph = 0;
+        stats_roundtrip();
+        have_geom = 1;
+      }
+      MonGroup *cands[2] = {&mon_group[j], g};
+      const XRectangle *crops[2] = {&blocks[j], &blocks[i]};
+      for (int k = 0; k < 2; k++) {
+        MonGroup *c = cands[k];
+        const XRectangle *b = crops[k];
+        if (c->crop_valid && c->crop_gen == wallpaper_gen && c->crop_rect.x == b->x &&
+            c->crop_rect.y == b->y && c->crop_rect.width == b->width &&
+            c->crop_rect.height == b->height)
+          continue;
+        c->crop = b->x >= 0 && b->y >= 0 && (unsigned int)(b->x + b->width) <= pw &&
+                          (unsigned int)(b->y + b->height) <= ph
+                      ? crop_hash(dpy, wallpaper_pm, b->x, b->y, b->width, b->height)
+                      : 0;
+        c->crop_rect = *b;
+        c->crop_valid = 1;
+        c->crop_gen = wallpaper_gen;
+      }
+      if (g->crop != 0 && g->crop == mon_group[j].crop)
+        g->leader = j;
     }
   }
+}
 
-  drw_map(drw, target_win, rx, ry, rw, rh);
+/* Whether the leader's updates this frame also bring monitor i up to date:
+ * i showed exactly what the leader showed before, offset by the distance
+ * between them, and the leader only repainted inside its unmoved block, the
+ * one part of the wallpaper the group compared. Once present_queue has had
+ * to merge rects, the leader's range may hold another monitor's too. */
+static int mon_can_replicate(int i, int l, Pixmap wallpaper_pm) {
+  const MonRect *m = &cached_monitors[i], *lm = &cached_monitors[l];
+  const MonState *st = &mon_state[i], *lead = &mon_group[l].prev;
+
+  if (present_merged || !lead->valid || lead->wallpaper != wallpaper_pm ||
+      lead->layout.rx != lm->x || lead->layout.ry != lm->y || lead->layout.rw != lm->w ||
+      lead->layout.rh != lm->h || !layout_equal(&lead->layout, &mon_state[l].layout))
+    return 0;
+  if (!st->valid || st->wallpaper != lead->wallpaper || strcmp(st->tstr, lead->tstr) != 0 ||
+      strcmp(st->dstr, lead->dstr) != 0 || st->refresh.width > 0)
+    return 0;
+  BlockLayout shifted = layout_shift(&lead->layout, m->x - lm->x, m->y - lm->y);
+  return layout_equal(&st->layout, &shifted);
+}
+
+/* Presents the leader's queued updates on monitor i as well */
+static void mon_replicate(Display *dpy, Window root, int i, int l) {
+  int dx = cached_monitors[i].x - cached_monitors[l].x;
+  int dy = cached_monitors[i].y - cached_monitors[l].y;
+
+  mon_state[i] = mon_state[l];
+  mon_state[i].layout = layout_shift(&mon_state[l].layout, dx, dy);
+  if (argb.active) {
+    /* the same buffer coordinates, in this monitor's own window */
+    const BlockLayout *lay = &mon_state[i].layout;
+    XRectangle g = {(short)lay->bx, (short)lay->by, (unsigned short)lay->bw,
+                    (unsigned short)lay->bh};
+    if (g.width == 0 || g.height == 0)
+      return;
+    argb_place(dpy, root, i, &g);
+    for (unsigned int k = mon_group[l].first; k < mon_group[l].end && argb.win[i] != None; k++) {
+      PresentRect r = present_rects[k];
+      present_queue(r.src, argb.win[i], r.sx, r.sy, r.dx, r.dy, (int)r.w, (int)r.h, r.pixel);
+    }
+    return;
+  }
+  for (unsigned int k = mon_group[l].first; k < mon_group[l].end && (dx || dy); k++) {
+    PresentRect r = present_rects[k];
+    present_queue(r.src, r.dst, r.sx, r.sy, r.dx + dx, r.dy + dy, (int)r.w, (int)r.h, r.pixel);
+  }
 }
 
 static void render_all(Drw *drw, Fnt *tf, Fnt *df, int show_date_flag, Clr *bg_scm, Clr *time_scm,
-                       Clr *date_scm, const char *time_fmt_s, const char *date_fmt_s,
-                       int block_y_off_s, int line_spacing_s, Window target_win) {
+                       Clr *date_scm, TimeFmt *time_fmt_s, TimeFmt *date_fmt_s,
+                       int block_y_off_s, int line_spacing_s, time_t now) {
   char tbuf[TIME_BUF_SIZE], dbuf[DATE_BUF_SIZE];
-  time_t now = time(NULL);
 
   if (now == (time_t)-1) {
     fprintf(stderr, "rootclock: time() failed, unable to get current time\n");
@@ -740,74 +3139,255 @@ static void render_all(Drw *drw, Fnt *tf, Fnt *df, int show_date_flag, Clr *bg_s
 
   /* Update last_displayed_time for consistent tracking */
   last_displayed_time = now;
+  if (shm.enabled)
+    shm_frame_begin(drw->dpy);
+  else
+    fence_wait(drw->dpy);
 
-  struct tm *tm_info = localtime(&now);
-  if (!tm_info) {
-    fprintf(stderr, "rootclock: localtime() failed, unable to format time\n");
-    exit(1);
-  }
-  if (strftime(tbuf, sizeof tbuf, time_fmt_s, tm_info) == 0) {
-    /* strftime failed or buffer too small, use fallback */
+  if (timefmt_format(time_fmt_s, tbuf, sizeof tbuf, now) == 0) {
+    /* empty or buffer too small, use fallback */
     snprintf(tbuf, sizeof tbuf, "%s", FALLBACK_TIME);
   }
 
   if (show_date_flag) {
-    if (strftime(dbuf, sizeof dbuf, date_fmt_s, tm_info) == 0) {
+    if (timefmt_format(date_fmt_s, dbuf, sizeof dbuf, now) == 0) {
       /* strftime failed or buffer too small, use fallback */
       snprintf(dbuf, sizeof dbuf, "%s", FALLBACK_DATE);
     }
   }
 
-  XineramaScreenInfo *xi = NULL;
-  int nmon = 1;
-  Pixmap wallpaper_pm = get_root_pixmap(drw->dpy, drw->root);
+  Pixmap wallpaper_pm = wallpaper_pixmap(drw->dpy, drw->root);
 
   /* Use cached monitor information */
   if (monitors_dirty) {
-    update_monitor_cache(drw->dpy);
+    update_monitor_cache(drw->dpy, drw->root);
   }
 
-  xi = cached_monitors;
-  nmon = cached_monitor_count;
+  /* without a wallpaper pixmap the root is sampled through a clean copy */
+  if (wallpaper_pm == None && bg_mode != BG_MODE_SOLID && !argb.active) {
+    bgcache_prepare(drw);
+    bgcache_update(drw);
+  } else {
+    bgcache_free(drw->dpy);
+  }
 
-  if (xi) {
-    for (int i = 0; i < nmon; i++) {
-      int rx = xi[i].x_org, ry = xi[i].y_org, rw = xi[i].width, rh = xi[i].height;
+  if (cached_monitor_count > 0) {
+    mon_group_update(drw->dpy, wallpaper_pm);
+    for (int i = 0; i < cached_monitor_count; i++) {
+      const MonRect *m = &cached_monitors[i];
+      int rx = m->x, ry = m->y, rw = m->w, rh = m->h;
       if (rw <= 0 || rh <= 0 || rw > MAX_SCREEN_DIMENSION || rh > MAX_SCREEN_DIMENSION) {
         continue;
       }
-      draw_block_for_region(drw, target_win, rx, ry, rw, rh, tf, df, show_date_flag, bg_scm,
-                            time_scm, date_scm, tbuf, show_date_flag ? dbuf : NULL, block_y_off_s,
-                            line_spacing_s, wallpaper_pm);
+      int l = mon_group[i].leader;
+      if (l != i && mon_can_replicate(i, l, wallpaper_pm)) {
+        mon_replicate(drw->dpy, drw->root, i, l);
+        /* copies that did not fit leave i behind: redraw it in full next time */
+        if (present_merged)
+          mon_state[i].valid = 0;
+        continue;
+      }
+      /* a follower out of sync (e.g. after a regroup) draws itself once */
+      mon_group[i].prev = mon_state[i];
+      mon_group[i].first = npresent;
+      draw_block_for_region(drw, rx, ry, rw, rh, tf, df, show_date_flag, bg_scm, time_scm,
+                            date_scm, tbuf, show_date_flag ? dbuf : NULL, block_y_off_s,
+                            line_spacing_s, wallpaper_pm, &mon_state[i]);
+      mon_group[i].end = npresent;
     }
   } else {
     int rw = DisplayWidth(drw->dpy, drw->screen);
     int rh = DisplayHeight(drw->dpy, drw->screen);
-    draw_block_for_region(drw, target_win, 0, 0, rw, rh, tf, df, show_date_flag, bg_scm, time_scm,
-                          date_scm, tbuf, show_date_flag ? dbuf : NULL, block_y_off_s,
-                          line_spacing_s, wallpaper_pm);
+    draw_block_for_region(drw, 0, 0, rw, rh, tf, df, show_date_flag, bg_scm, time_scm, date_scm,
+                          tbuf, show_date_flag ? dbuf : NULL, block_y_off_s, line_spacing_s,
+                          wallpaper_pm, &mon_state[0]);
+  }
+}
+
+/* The wallpaper property as it was before the benchmark replaced it */
+static struct {
+  int saved; /* the property existed */
+  Pixmap prev;
+  Pixmap pm; /* the benchmark's own wallpaper */
+} bench_root;
+
+/* Publishes a deterministic wallpaper so the copy and blend modes have
+ * something to work on and every run starts from the same pixels. What it
+ * replaces is put back by bench_restore. */
+static void bench_wallpaper(Display *dpy, int screen, Window root) {
+  unsigned int w = DisplayWidth(dpy, screen), h = DisplayHeight(dpy, screen);
+  Atom type;
+  int format;
+  unsigned long n, after;
+  unsigned char *data = NULL;
+
+  if (XGetWindowProperty(dpy, root, atoms[AtomXRootPmap], 0, 1, False, XA_PIXMAP, &type,
+                         &format, &n, &after, &data) == Success &&
+      type == XA_PIXMAP && format == 32 && n == 1) {
+    bench_root.saved = 1;
+    bench_root.prev = *(Pixmap *)data;
+  }
+  if (data)
+    XFree(data);
+
+  Pixmap pm = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+  GC gc = XCreateGC(dpy, pm, 0, NULL);
+  for (unsigned int y = 0; y < h; y += BENCH_CELL) {
+    for (unsigned int x = 0; x < w; x += BENCH_CELL) {
+      unsigned long r = (x * 255 / w) & 0xff, g = (y * 255 / h) & 0xff;
+      unsigned long b = ((x / BENCH_CELL + y / BENCH_CELL) & 1) ? 0xc0 : 0x40;
+      XSetForeground(dpy, gc, (r << 16) | (g << 8) | b);
+      XFillRectangle(dpy, pm, gc, (int)x, (int)y, BENCH_CELL, BENCH_CELL);
+    }
   }
+  XFreeGC(dpy, gc);
+  XChangeProperty(dpy, root, atoms[AtomXRootPmap], XA_PIXMAP, 32, PropModeReplace,
+                  (unsigned char *)&pm, 1);
+  XSync(dpy, False);
+  bench_root.pm = pm;
+  wallpaper_dirty = 1;
+}
+
+/* Puts the wallpaper property back as bench_wallpaper found it, so it does
+ * not point at a pixmap that goes away with the connection */
+static void bench_restore(Display *dpy, Window root) {
+  if (bench_root.pm == None)
+    return;
+  if (bench_root.saved)
+    XChangeProperty(dpy, root, atoms[AtomXRootPmap], XA_PIXMAP, 32, PropModeReplace,
+                    (unsigned char *)&bench_root.prev, 1);
+  else
+    XDeleteProperty(dpy, root, atoms[AtomXRootPmap]);
+  XFreePixmap(dpy, bench_root.pm);
+  bench_root.pm = None;
+  XSync(dpy, False);
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Renders frames ticks starting at start through the normal render and
+ * present path, waiting for the server after each so its work is included,
+ * and prints one summary line. The first frames warm the caches and are
+ * not measured. */
+static void bench_run(Drw *drw, Window win, Fnt *tf, Fnt *df, Clr *bg_scm, Clr *time_scm,
+                      Clr *date_scm, int frames, time_t start) {
+  int warmup = MIN(frames / 10, 5);
+  double *t = ecalloc(frames, sizeof *t);
+  unsigned long long req = 0, rt = 0, bytes = 0, pixels = 0;
+  struct timespec a, b;
+
+  for (int i = 0; i < warmup + frames; i++) {
+    time_t now = start + (time_t)i * tick_step;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    stats_frame_begin(drw->dpy);
+    render_all(drw, tf, df, show_date, bg_scm, time_scm, date_scm, time_prog, date_prog,
+               block_y_off, line_spacing, now);
+    present_flush(drw, win);
+    stats_frame_end(drw->dpy);
+    XSync(drw->dpy, False);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    if (i < warmup)
+      continue;
+    t[i - warmup] = (double)(b.tv_sec - a.tv_sec) * 1e6 + (b.tv_nsec - a.tv_nsec) / 1e3;
+    req += stats_frame.requests;
+    rt += stats_frame.round_trips;
+    bytes += stats_frame.bytes;
+    pixels += stats_frame.pixels;
+  }
+  qsort(t, frames, sizeof *t, cmp_double);
+  printf("mode=%s blend=%s frames=%d p50_us=%.1f p99_us=%.1f max_us=%.1f requests=%.1f "
+         "round_trips=%.1f bytes=%.0f pixels=%.0f\n",
+         bg_mode_names[bg_mode], shm.enabled ? shm.isa : "render", frames, t[frames / 2],
+         t[(frames * 99) / 100], t[frames - 1], (double)req / frames, (double)rt / frames,
+         (double)bytes / frames, (double)pixels / frames);
+  free(t);
+}
+
+static void usage(void) {
+  die("usage: rootclock [-b frames [-m solid|copy|invert|multiply|screen|overlay|darken|lighten] "
+      "[-t epoch]]");
+}
+
+/* The whole of s as a decimal number in [min, max]; anything else is a
+ * usage error */
+static long long parse_num(const char *s, long long min, long long max) {
+  char *end;
+  errno = 0;
+  long long v = strtoll(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || v < min || v > max)
+    usage();
+  return v;
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+  int bench_frames = 0;
+  int bench_opts = 0; /* -m or -t given, which only apply to -b runs */
+  time_t bench_start = BENCH_START;
+
+  bg_mode = background_mode;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(argv[i], "-b") && arg) {
+      bench_frames = (int)parse_num(arg, 1, INT_MAX);
+    } else if (!strcmp(argv[i], "-m") && arg) {
+      bg_mode = -1;
+      for (int m = 0; m < (int)LENGTH(bg_mode_names); m++)
+        if (!strcmp(arg, bg_mode_names[m]))
+          bg_mode = m;
+      if (bg_mode < 0)
+        usage();
+      bench_opts = 1;
+    } else if (!strcmp(argv[i], "-t") && arg) {
+      bench_start = (time_t)parse_num(arg, LLONG_MIN, LLONG_MAX);
+      bench_opts = 1;
+    } else {
+      usage();
+    }
+    i++;
+  }
+  /* the daemon takes background_mode from config.h like everything else */
+  if (bench_opts && !bench_frames)
+    usage();
+
   setlocale(LC_ALL, "");
+  /* names in the formats are rendered once, in this locale */
+  time_prog = timefmt_compile(time_fmt);
+  date_prog = timefmt_compile(date_fmt);
+  if (!time_prog || !date_prog)
+    die("rootclock: time_fmt or date_fmt is too long");
+
+  /* SIGINT/SIGTERM stop, SIGHUP forces a full redraw; all via signalfd */
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0)
+    die("rootclock: sigprocmask:");
+  int sfd = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK);
+  int tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+  int dfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (sfd < 0 || tfd < 0 || dfd < 0 || epfd < 0)
+    die("rootclock: cannot set up event loop:");
 
-  struct sigaction sa;
-  sa.sa_handler = signal_handler;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sigaction(SIGINT, &sa, NULL);
-  sigaction(SIGTERM, &sa, NULL);
   Display *dpy = XOpenDisplay(NULL);
   if (!dpy) {
     fputs("rootclock: cannot open display\n", stderr);
     return 1;
   }
+  stats_init(dpy);
   int screen = DefaultScreen(dpy);
   Window root = RootWindow(dpy, screen);
   Window draw_win = root;
   Window desktop_win = None;
-  int compositor_active = compositor_is_active(dpy, screen);
+  intern_atoms(dpy, screen);
+  Atom cm_sel = atoms[AtomCmSel];
+  int fixes_event_base = compositor_watch(dpy, root, cm_sel);
+  int compositor_active = compositor_is_active(dpy, cm_sel);
 
   XWindowAttributes root_attr;
   if (XGetWindowAttributes(dpy, root, &root_attr) && root_attr.visual) {
@@ -824,18 +3404,57 @@ int main(void) {
     XCloseDisplay(dpy);
     return 1;
   }
-  Drw *drw = drw_create(dpy, screen, root, rw, rh);
+  /* with block buffers drw->drawable is only a placeholder between binds */
+  Drw *drw = buffer_mode == BUFFER_BLOCK ? drw_create(dpy, screen, root, 1, 1)
+                                         : drw_create(dpy, screen, root, rw, rh);
   if (!drw) {
     fprintf(stderr, "rootclock: failed to create drawing context\n");
     XCloseDisplay(dpy);
     return 1;
   }
 
-  Fnt *tf = drw_fontset_create(drw, time_fonts, LENGTH(time_fonts));
-  Fnt *df = show_date ? drw_fontset_create(drw, date_fonts, LENGTH(date_fonts)) : NULL;
+  /* a warm start reopens the fonts and advances the last cold start
+   * resolved instead of asking fontconfig again */
+  FcacheSet cached[2];
+  unsigned long long font_key = use_font_cache ? font_cache_key(dpy, screen) : 0;
+  int warm = use_font_cache && fcache_load(font_key, cached, show_date ? 2 : 1);
+  Fnt *tf = NULL, *df = NULL;
+  if (warm) {
+    tf = fontset_from_cache(drw, &cached[0]);
+    df = show_date ? fontset_from_cache(drw, &cached[1]) : NULL;
+    if (!tf || (show_date && !df)) {
+      drw_fontset_free(tf);
+      drw_fontset_free(df);
+      tf = df = NULL;
+      warm = 0;
+    } else {
+      drw_setfontset(drw, df ? df : tf);
+    }
+  }
+  if (!warm) {
+    tf = drw_fontset_create(drw, time_fonts, LENGTH(time_fonts));
+    df = show_date ? drw_fontset_create(drw, date_fonts, LENGTH(date_fonts)) : NULL;
+  }
   if (!tf || (show_date && !df))
     die("rootclock: failed to load fonts");
 
+  adv_build(drw, &time_adv, tf, time_fmt, warm ? &cached[0] : NULL);
+  if (show_date)
+    adv_build(drw, &date_adv, df, date_fmt, warm ? &cached[1] : NULL);
+  if (use_glyph_atlas) {
+    atlas_build(drw, &time_atlas, tf, time_fmt, warm ? &cached[0] : NULL);
+    if (show_date)
+      atlas_build(drw, &date_atlas, df, date_fmt, warm ? &cached[1] : NULL);
+  }
+  if (use_font_cache && !warm)
+    font_cache_save(drw, font_key, tf, df);
+  fcache_release();
+  const char *blend_isa = blend_init();
+  shm.enabled = blend_probe(drw);
+  if (!shm.enabled)
+    shm_free(dpy);
+  shm.isa = blend_isa;
+
   /* color schemes:
      index order: ColFg, ColBg, ColBorder
      We'll use:
@@ -853,7 +3472,9 @@ int main(void) {
     die("rootclock: color alloc failed");
 
   unsigned long bg_pixel = XBlackPixel(dpy, screen);
-  if (compositor_active) {
+  if (compositor_active && desktop_mode == DESKTOP_BLOCK && argb_init(dpy, screen, root)) {
+    argb.active = 1;
+  } else if (compositor_active) {
     desktop_win = create_desktop_window(dpy, screen, root, rw, rh, bg_pixel);
     if (desktop_win != None) {
       draw_win = desktop_win;
@@ -865,163 +3486,272 @@ int main(void) {
     }
   }
 
-  XSelectInput(dpy, root, ExposureMask | StructureNotifyMask);
+  XSelectInput(dpy, root, ExposureMask | StructureNotifyMask | PropertyChangeMask);
+  randr_watch(dpy, root);
+
+  if (refresh_sec > 0)
+    tick_step = MIN(refresh_sec, TICK_DAY);
+  else
+    tick_step = MIN(timefmt_unit(time_prog), show_date ? timefmt_unit(date_prog) : TICK_DAY);
+
+  if (root_background && desktop_win == None && !argb.active)
+    root_bg_install(drw, bg_pixel, rw, rh);
 
-  /* loop: redraw on expose/resize and on timer ticks */
+  if (bench_frames > 0) {
+    bench_wallpaper(dpy, screen, root);
+    bench_run(drw, root_bg != None ? root_bg : draw_win, tf, df, bg_scm, time_scm, date_scm,
+              bench_frames, bench_start);
+    running = 0;
+  }
+
+  /* loop: redraw on expose/resize, on timer ticks and on clock changes */
   int xfd = ConnectionNumber(dpy);
+  if (loop_add(epfd, xfd, LOOP_X) < 0 || loop_add(epfd, tfd, LOOP_TICK) < 0 ||
+      loop_add(epfd, dfd, LOOP_TOPOLOGY) < 0 || loop_add(epfd, sfd, LOOP_SIGNAL) < 0)
+    die("rootclock: epoll_ctl:");
+  /* without inotify a timezone change shows at the next offset change */
+  int zfd = tz_watch();
+  if (zfd >= 0 && loop_add(epfd, zfd, LOOP_TZ) < 0)
+    die("rootclock: epoll_ctl:");
   int need_redraw = 1;
+  int pending = 0; /* drw->drawable holds a prerendered frame for last_displayed_time */
+  struct timespec tick_at = {0, 0}; /* instant the tick timer is armed for */
+  time_t stats_written = 0;
   while (running) {
     while (XPending(dpy)) {
       XEvent ev;
       XNextEvent(dpy, &ev);
+      if (is_topology_event(&ev, root)) {
+        /* hotplug produces bursts of these: apply them once things settle */
+        if (randr_event_base >= 0)
+          XRRUpdateConfiguration(&ev);
+        if (topology_arm(dfd) < 0)
+          die("rootclock: timerfd_settime:");
+        continue;
+      }
       switch (ev.type) {
       case Expose:
-        if (ev.xexpose.window == root || ev.xexpose.window == draw_win)
+        /* with root_bg installed the server has already repainted it; over
+         * the clean copy, only the blocks the exposure wiped need drawing */
+        if (root_bg == None && ev.xexpose.window == root && draw_win == root &&
+            bgcache.pm != None) {
+          if (bgcache_expose(dpy, root, &ev.xexpose))
+            need_redraw = 1;
+        } else if ((root_bg == None &&
+                    (ev.xexpose.window == root || ev.xexpose.window == draw_win)) ||
+                   is_argb_window(ev.xexpose.window)) {
+          mon_state_invalidate();
           need_redraw = 1;
+        }
         break;
-      case ConfigureNotify: {
-        unsigned int nrw = DisplayWidth(dpy, screen);
-        unsigned int nrh = DisplayHeight(dpy, screen);
-        if (nrw != drw->w || nrh != drw->h)
-          drw_resize(drw, nrw, nrh);
-        if (desktop_win != None && (nrw != rw || nrh != rh)) {
-          XResizeWindow(dpy, desktop_win, nrw, nrh);
-          XLowerWindow(dpy, desktop_win);
+      case PropertyNotify:
+        if (ev.xproperty.window == root && is_wallpaper_atom(ev.xproperty.atom)) {
+          /* new wallpaper, possibly reusing the old pixmap ID; ask for it now so
+           * the answer travels with this iteration's other queries */
+          wallpaper_dirty = 1;
+          query_root_pixmap(dpy, root);
+          need_redraw = 1;
         }
-        rw = nrw;
-        rh = nrh;
-        monitors_dirty = 1; /* mark monitors as needing refresh */
-        need_redraw = 1;
-      } break;
+        break;
       default:
+        if (bgcache.event_base > 0 && ev.type == bgcache.event_base + XDamageNotify) {
+          /* taken with the next frame, no need to draw one for it */
+          bgcache.damaged = 1;
+        } else if (fixes_event_base >= 0 &&
+                   ev.type == fixes_event_base + XFixesSelectionNotify) {
+          XFixesSelectionNotifyEvent *se = (XFixesSelectionNotifyEvent *)&ev;
+          if (se->selection == cm_sel)
+            compositor_active =
+                se->subtype == XFixesSetSelectionOwnerNotify && se->owner != None;
+        }
         break;
       }
     }
 
-    int compositor_now = compositor_is_active(dpy, screen);
-    if (compositor_now && desktop_win == None) {
+    /* without XFixes there are no ownership events to wait for */
+    int compositor_now =
+        fixes_event_base >= 0 ? compositor_active : compositor_is_active(dpy, cm_sel);
+    if (compositor_now && desktop_mode == DESKTOP_BLOCK && !argb.active &&
+        argb_init(dpy, screen, root)) {
+      argb.active = 1;
+      mon_state_invalidate();
+      need_redraw = 1;
+    } else if (!compositor_now && argb.active) {
+      argb_destroy(dpy, 0);
+      argb.active = 0;
+      mon_state_invalidate();
+      need_redraw = 1;
+    }
+    if (compositor_now && !argb.active && desktop_win == None) {
       desktop_win = create_desktop_window(dpy, screen, root, rw, rh, bg_pixel);
       if (desktop_win != None) {
         draw_win = desktop_win;
         XSelectInput(dpy, desktop_win, ExposureMask);
+        mon_state_invalidate();
         need_redraw = 1;
       }
     } else if (!compositor_now && desktop_win != None) {
       destroy_desktop_window(dpy, &desktop_win);
       draw_win = root;
+      mon_state_invalidate();
       need_redraw = 1;
     }
     compositor_active = compositor_now;
-
-    /* Check if time has changed (for second-precise updates) */
+    /* a compositor shows its windows instead of the root background */
+    if (root_background && desktop_win == None && !argb.active)
+      root_bg_install(drw, bg_pixel, rw, rh);
+    else
+      root_bg_uninstall(drw);
+    Window target = root_bg != None ? root_bg : draw_win;
+
+    /* Redraw once the formatted output can have changed, or right away if the
+     * clock was set backwards */
     time_t current_time = time(NULL);
-    if (current_time != last_displayed_time && current_time != (time_t)-1) {
+    if (current_time != (time_t)-1 && !pending &&
+        (current_time < last_displayed_time || current_time >= sched_next(last_displayed_time))) {
       need_redraw = 1;
     }
 
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
     if (need_redraw) {
-      render_all(drw, tf, df, show_date, bg_scm, time_scm, date_scm, time_fmt, date_fmt,
-                 block_y_off, line_spacing, draw_win);
+      /* immediate frame; also supersedes a prerendered one still queued */
+      stats_frame_begin(dpy);
+      render_all(drw, tf, df, show_date, bg_scm, time_scm, date_scm, time_prog, date_prog,
+                 block_y_off, line_spacing, current_time);
+      present_flush(drw, target);
+      stats_frame_end(dpy);
+      pending = 0;
       need_redraw = 0;
+    } else if (pending && ts.tv_sec >= last_displayed_time) {
+      /* the prerendered second has begun: only the copies are left */
+      stats_frame_begin(dpy);
+      present_flush(drw, target);
+      stats_frame_end(dpy);
+      pending = 0;
+    }
+    if (stats_file && stats_frame.frames && ts.tv_sec - stats_written >= stats_interval_sec) {
+      if (stats_write(stats_file) < 0)
+        fprintf(stderr, "rootclock: cannot write %s\n", stats_file);
+      stats_written = ts.tv_sec;
     }
 
-    /* Calculate timeout for next update - align to appropriate time boundaries */
-    struct timeval tv;
-    struct timespec ts;
-    if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
-      if (refresh_sec == 1) {
-        /* For 1-second updates, use precise second-boundary alignment */
-        long usec_in_sec = (ts.tv_nsec / 1000) % 1000000;
-
-        if (usec_in_sec < 950000) {
-          /* We're not too close to the next second, wait until 50ms before it */
-          tv.tv_sec = 0;
-          tv.tv_usec = (950000 - usec_in_sec);
-        } else {
-          /* We're very close to or past 950ms mark, wait for next second + 50ms */
-          tv.tv_sec = 0;
-          tv.tv_usec = (1050000 - usec_in_sec);
-          if (tv.tv_usec < 0)
-            tv.tv_usec = 0;
+    /* Sleep until the next instant there is work: prerendering the next
+     * change, presenting it on its boundary, or rendering it directly */
+    struct timespec deadline;
+    if (pending) {
+      deadline.tv_sec = last_displayed_time;
+      deadline.tv_nsec = 0;
+    } else {
+      time_t next = sched_next(current_time);
+      deadline = prerender_deadline(next);
+      if (prerender_ms > 0 && (ts.tv_sec > deadline.tv_sec ||
+                               (ts.tv_sec == deadline.tv_sec && ts.tv_nsec >= deadline.tv_nsec))) {
+        stats_frame_begin(dpy);
+        render_all(drw, tf, df, show_date, bg_scm, time_scm, date_scm, time_prog, date_prog,
+                   block_y_off, line_spacing, next);
+        XFlush(dpy);
+        stats_frame_pause();
+        pending = 1;
+        deadline.tv_sec = next;
+        deadline.tv_nsec = 0;
+      }
+    }
+    if (deadline.tv_sec != tick_at.tv_sec || deadline.tv_nsec != tick_at.tv_nsec) {
+      if (tick_arm(tfd, &deadline) < 0)
+        die("rootclock: timerfd_settime:");
+      tick_at = deadline;
+    }
+
+    /* replies waited for while rendering can have pulled events off the
+     * socket into Xlib's or XCB's queue, where epoll does not see them:
+     * only block once both are empty */
+    struct epoll_event evs[4];
+    int n = epoll_wait(epfd, evs, LENGTH(evs), XPending(dpy) ? 0 : -1);
+    if (n < 0 && errno != EINTR)
+      break;
+    for (int i = 0; i < n; i++) {
+      switch (evs[i].data.u32) {
+      case LOOP_TICK: {
+        uint64_t expirations;
+        if (read(tfd, &expirations, sizeof expirations) < 0 && errno == ECANCELED) {
+          /* the realtime clock was set: redraw now and re-arm */
+          tick_at.tv_sec = tick_at.tv_nsec = 0;
+          need_redraw = 1;
         }
-      } else {
-        /* For longer intervals, align to time boundaries based on refresh_sec */
-        time_t current_time = ts.tv_sec;
-        time_t next_boundary;
-
-        if (refresh_sec >= 3600) {
-          /* Hourly or longer: align to hour boundaries */
-          struct tm *tm_info = localtime(&current_time);
-          if (tm_info) {
-            tm_info->tm_sec = 0;
-            tm_info->tm_min = 0;
-            tm_info->tm_hour++;
-            next_boundary = mktime(tm_info);
-          } else {
-            next_boundary = current_time + refresh_sec;
-          }
-        } else if (refresh_sec >= 60) {
-          /* Minute-level intervals: align to minute boundaries */
-          struct tm *tm_info = localtime(&current_time);
-          if (tm_info) {
-            tm_info->tm_sec = 0;
-            /* For refresh_sec like 59, we want next minute boundary */
-            /* For refresh_sec like 120, we want appropriate minute alignment */
-            int minute_interval = (refresh_sec + 30) / 60; /* round to nearest minute */
-            tm_info->tm_min = ((tm_info->tm_min / minute_interval) + 1) * minute_interval;
-            next_boundary = mktime(tm_info);
-          } else {
-            next_boundary = current_time + refresh_sec;
-          }
-        } else {
-          /* Short intervals: align to second boundaries with refresh_sec spacing */
-          next_boundary = ((current_time / refresh_sec) + 1) * refresh_sec;
+      } break;
+      case LOOP_TOPOLOGY: {
+        uint64_t expirations;
+        if (read(dfd, &expirations, sizeof expirations) < 0)
+          break;
+        /* one relayout and at most one buffer reallocation per burst */
+        unsigned int nrw = DisplayWidth(dpy, screen);
+        unsigned int nrh = DisplayHeight(dpy, screen);
+        if (buffer_mode != BUFFER_BLOCK && (nrw != drw->w || nrh != drw->h)) {
+          drw_resize(drw, nrw, nrh);
+          rcache_drop_dst(dpy);
         }
-
-        time_t wait_time = next_boundary - current_time;
-        if (wait_time <= 0) {
-          wait_time = 1; /* minimum wait */
+        if (desktop_win != None && (nrw != rw || nrh != rh)) {
+          XResizeWindow(dpy, desktop_win, nrw, nrh);
+          XLowerWindow(dpy, desktop_win);
         }
-
-        /* Wake up 50ms before the boundary for smooth updates */
-        if (wait_time > 1) {
-          tv.tv_sec = wait_time - 1;
-          tv.tv_usec = 950000; /* 950ms into the previous second */
-        } else {
-          tv.tv_sec = 0;
-          tv.tv_usec = wait_time * 1000000 - 50000; /* 50ms before */
-          if (tv.tv_usec < 0) {
-            tv.tv_sec = 0;
-            tv.tv_usec = 0;
+        rw = nrw;
+        rh = nrh;
+        monitors_dirty = 1; /* mark monitors as needing refresh */
+        mon_state_invalidate();
+        need_redraw = 1;
+      } break;
+      case LOOP_SIGNAL: {
+        struct signalfd_siginfo si;
+        while (read(sfd, &si, sizeof si) == (ssize_t)sizeof si) {
+          if (si.ssi_signo == SIGHUP) {
+            monitors_dirty = 1;
+            mon_state_invalidate();
+            need_redraw = 1;
+          } else {
+            running = 0;
           }
         }
+      } break;
+      case LOOP_TZ:
+        if (tz_handle(zfd))
+          need_redraw = 1;
+        break;
+      default: /* X events are drained at the top of the loop */
+        break;
       }
-    } else {
-      /* Fallback to simple periodic updates */
-      tv.tv_sec = refresh_sec;
-      tv.tv_usec = 0;
-    }
-
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(xfd, &fds);
-    int r = select(xfd + 1, &fds, NULL, NULL, &tv);
-    if (r == 0) {
-      need_redraw = 1; /* timeout - force redraw */
-    } else if ((r < 0 && errno != EINTR) || !running) {
-      break;
     }
   }
 
+  root_bg_uninstall(drw);
+  bench_restore(dpy, root);
+  bgcache_free(dpy);
+  argb_free(dpy);
+  shm_free(dpy);
+  for (int i = 0; i < MAX_MONITORS; i++) {
+    block_buf_free(dpy, &block_bufs[i]);
+    line_layers_free(dpy, line_layers[i]);
+  }
+  if (layer_gc)
+    XFreeGC(dpy, layer_gc);
+  rcache_free(dpy);
+  atlas_free(dpy, &time_atlas);
+  atlas_free(dpy, &date_atlas);
   free(bg_scm);
   free(time_scm);
   free(date_scm);
-  if (cached_monitors)
-    XFree(cached_monitors);
   destroy_desktop_window(dpy, &desktop_win);
   if (drw)
     drw_free(drw);
   XCloseDisplay(dpy);
+  timefmt_free(time_prog);
+  timefmt_free(date_prog);
+  if (zfd >= 0)
+    close(zfd);
+  close(epfd);
+  close(dfd);
+  close(tfd);
+  close(sfd);
 
   return 0;
 }
@@ -0,0 +1,156 @@
+/* See LICENSE file for copyright and license details. */
+#define _POSIX_C_SOURCE 200809L
+#include <X11/Xlib.h>
+#include <X11/Xlibint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+XStats stats_total;
+XStats stats_frame;
+
+static XStats frame_start;
+static unsigned long frame_start_request;
+static unsigned long start_request;
+static unsigned int xcb_sequence; /* last request sent through XCB directly */
+static struct timespec frame_start_ts;
+static double frame_elapsed;
+static int frame_open, frame_running;
+
+static void count_flush(Display *dpy, XExtCodes *codes, const char *data, long len) {
+  (void)dpy;
+  (void)codes;
+  (void)data;
+  if (len > 0)
+    stats_total.bytes += (unsigned long long)len;
+}
+
+/* Requests sent straight through XCB bypass both the flush hook and, until
+ * Xlib next takes the socket back, its request count */
+void stats_xcb_request(unsigned int sequence, unsigned int len) {
+  xcb_sequence = sequence;
+  stats_total.bytes += len;
+}
+
+/* Sequence number of the last request sent either way. XCB's are the low
+ * 32 bits of Xlib's. */
+static unsigned long last_request(Display *dpy) {
+  unsigned long req = NextRequest(dpy) - 1;
+  int ahead = (int)(xcb_sequence - (unsigned int)req);
+  return ahead > 0 ? req + (unsigned long)ahead : req;
+}
+
+/* Hooks the Xlib output buffer so every flushed byte is counted */
+void stats_init(Display *dpy) {
+  XExtCodes *codes = XAddExtension(dpy);
+  if (codes)
+    XESetBeforeFlush(dpy, codes->extension, count_flush);
+  start_request = last_request(dpy);
+}
+
+void stats_roundtrip(void) { stats_total.round_trips++; }
+
+void stats_pixels(unsigned int w, unsigned int h) {
+  stats_total.pixels += (unsigned long long)w * h;
+}
+
+static double elapsed_since(const struct timespec *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+/* Opens a frame, or resumes the clock of one that was paused after
+ * prerendering so the wait for the boundary is not counted */
+void stats_frame_begin(Display *dpy) {
+  if (!frame_open) {
+    frame_open = 1;
+    frame_elapsed = 0;
+    stats_total.requests = last_request(dpy) - start_request;
+    frame_start = stats_total;
+    frame_start_request = last_request(dpy);
+  }
+  if (!frame_running) {
+    frame_running = 1;
+    clock_gettime(CLOCK_MONOTONIC, &frame_start_ts);
+  }
+}
+
+void stats_frame_pause(void) {
+  if (!frame_running)
+    return;
+  frame_running = 0;
+  frame_elapsed += elapsed_since(&frame_start_ts);
+}
+
+void stats_frame_end(Display *dpy) {
+  if (!frame_open)
+    return;
+  stats_frame_pause();
+  frame_open = 0;
+  stats_total.requests = last_request(dpy) - start_request;
+  stats_total.frames++;
+  stats_frame.requests = last_request(dpy) - frame_start_request;
+  stats_frame.round_trips = stats_total.round_trips - frame_start.round_trips;
+  stats_frame.bytes = stats_total.bytes - frame_start.bytes;
+  stats_frame.pixels = stats_total.pixels - frame_start.pixels;
+  stats_frame.frames = 1;
+  stats_frame.seconds = frame_elapsed;
+  stats_total.seconds += stats_frame.seconds;
+}
+
+/* Writes the counters in the Prometheus textfile-collector format. The file
+ * is replaced atomically so a scraper never sees a partial write. */
+int stats_write(const char *path) {
+  static const struct {
+    const char *name, *type, *help;
+    size_t off;
+    int frame;
+  } metrics[] = {
+      {"x_requests_total", "counter", "X requests issued, through Xlib or XCB.",
+       offsetof(XStats, requests), 0},
+      {"x_round_trips_total", "counter", "Synchronous X round trips.",
+       offsetof(XStats, round_trips), 0},
+      {"x_bytes_sent_total", "counter", "Bytes sent to the X server.", offsetof(XStats, bytes),
+       0},
+      {"pixels_copied_total", "counter", "Pixels copied between drawables.",
+       offsetof(XStats, pixels), 0},
+      {"frames_total", "counter", "Frames rendered.", offsetof(XStats, frames), 0},
+      {"last_frame_x_requests", "gauge", "X requests issued by the last frame.",
+       offsetof(XStats, requests), 1},
+      {"last_frame_x_round_trips", "gauge", "Round trips made by the last frame.",
+       offsetof(XStats, round_trips), 1},
+      {"last_frame_x_bytes_sent", "gauge", "Bytes sent by the last frame.",
+       offsetof(XStats, bytes), 1},
+      {"last_frame_pixels_copied", "gauge", "Pixels copied by the last frame.",
+       offsetof(XStats, pixels), 1},
+  };
+  char tmp[4096];
+  FILE *f;
+
+  if (!path || snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp)
+    return -1;
+  if (!(f = fopen(tmp, "w")))
+    return -1;
+  for (size_t i = 0; i < sizeof metrics / sizeof metrics[0]; i++) {
+    const XStats *src = metrics[i].frame ? &stats_frame : &stats_total;
+    unsigned long long v = *(const unsigned long long *)((const char *)src + metrics[i].off);
+    fprintf(f, "# HELP rootclock_%s %s\n# TYPE rootclock_%s %s\nrootclock_%s %llu\n",
+            metrics[i].name, metrics[i].help, metrics[i].name, metrics[i].type, metrics[i].name, v);
+  }
+  fprintf(f, "# HELP rootclock_render_seconds_total Time spent rendering frames.\n"
+             "# TYPE rootclock_render_seconds_total counter\n"
+             "rootclock_render_seconds_total %.6f\n",
+          stats_total.seconds);
+  fprintf(f, "# HELP rootclock_last_frame_seconds Time the last frame took.\n"
+             "# TYPE rootclock_last_frame_seconds gauge\n"
+             "rootclock_last_frame_seconds %.6f\n",
+          stats_frame.seconds);
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
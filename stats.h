@@ -0,0 +1,24 @@
+/* See LICENSE file for copyright and license details. */
+
+/* X request accounting: counters for what rootclock costs the X server,
+ * per frame and since startup. */
+typedef struct {
+  unsigned long long requests;    /* protocol requests issued */
+  unsigned long long round_trips; /* calls that waited for a reply */
+  unsigned long long bytes;       /* bytes sent to the server */
+  unsigned long long pixels;      /* pixels copied between drawables */
+  unsigned long long frames;
+  double seconds; /* wall time spent rendering and presenting */
+} XStats;
+
+extern XStats stats_total;
+extern XStats stats_frame; /* last completed frame */
+
+void stats_init(Display *dpy);
+void stats_xcb_request(unsigned int sequence, unsigned int len);
+void stats_roundtrip(void);
+void stats_pixels(unsigned int w, unsigned int h);
+void stats_frame_begin(Display *dpy);
+void stats_frame_pause(void);
+void stats_frame_end(Display *dpy);
+int stats_write(const char *path);
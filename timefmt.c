@@ -0,0 +1,513 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timefmt.h"
+#include "util.h"
+
+#define TZ_FILE "/etc/localtime"
+#define TZ_DIR "/etc"
+#define TZ_SCAN_DAYS 400 /* how far ahead the next offset change is looked for */
+#define TZ_FILE_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define TZ_DIR_EVENTS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB)
+#define TIMEFMT_OPS 64
+#define TIMEFMT_POOL 1024
+#define TIMEFMT_LINE 256
+#define DAY 86400
+
+static struct {
+  int valid;
+  time_t from, until; /* the offset holds for from <= t < until */
+  long gmtoff;
+  int isdst;
+  char zone[16];
+  unsigned long gen; /* bumped by every refresh; formatted lines check it */
+  int file_wd, dir_wd;
+} tz = {.file_wd = -1, .dir_wd = -1};
+
+static long long floor_div(long long a, long long b) {
+  long long q = a / b;
+  return q - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date, and back */
+static long long days_from_civil(long long y, int m, int d) {
+  y -= m <= 2;
+  long long era = floor_div(y, 400);
+  long long yoe = y - era * 400;
+  long long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static void civil_from_days(long long z, long long *y, int *m, int *d) {
+  z += 719468;
+  long long era = floor_div(z, 146097);
+  long long doe = z - era * 146097;
+  long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long long mp = (5 * doy + 2) / 153;
+  *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+  *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+static int same_zone(time_t t, long gmtoff, int isdst) {
+  struct tm tm;
+  return localtime_r(&t, &tm) && tm.tm_gmtoff == gmtoff && tm.tm_isdst == isdst;
+}
+
+/* First instant after t in another zone state: found day by day, then
+ * narrowed down to the second */
+static time_t tz_scan(time_t t) {
+  time_t lo = t, hi = t;
+  int d;
+
+  for (d = 1; d <= TZ_SCAN_DAYS; d++) {
+    hi = t + (time_t)d * DAY;
+    if (!same_zone(hi, tz.gmtoff, tz.isdst))
+      break;
+    lo = hi;
+  }
+  if (d > TZ_SCAN_DAYS)
+    return hi; /* no change in sight: look again then */
+  while (hi - lo > 1) {
+    time_t mid = lo + (hi - lo) / 2;
+    if (same_zone(mid, tz.gmtoff, tz.isdst))
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return hi;
+}
+
+static void tz_refresh(time_t t) {
+  struct tm tm;
+
+  /* re-reads TZ and, when it changed, /etc/localtime */
+  tzset();
+  if (localtime_r(&t, &tm)) {
+    tz.gmtoff = tm.tm_gmtoff;
+    tz.isdst = tm.tm_isdst;
+    snprintf(tz.zone, sizeof tz.zone, "%s", tm.tm_zone ? tm.tm_zone : "");
+    tz.until = tz_scan(t);
+  } else {
+    tz.gmtoff = 0;
+    tz.isdst = 0;
+    snprintf(tz.zone, sizeof tz.zone, "UTC");
+    tz.until = t + 1;
+  }
+  tz.from = t;
+  tz.valid = 1;
+  tz.gen++;
+}
+
+/* Watches /etc/localtime, and /etc for it being replaced, so a timezone
+ * change is seen without polling. Returns the inotify fd, or -1. */
+int tz_watch(void) {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  tz.dir_wd = inotify_add_watch(fd, TZ_DIR, TZ_DIR_EVENTS);
+  tz.file_wd = inotify_add_watch(fd, TZ_FILE, TZ_FILE_EVENTS);
+  if (tz.dir_wd < 0 && tz.file_wd < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Drains fd; returns 1 if the timezone may have changed, in which case the
+ * cached offset has been dropped */
+int tz_handle(int fd) {
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  ssize_t n;
+  int changed = 0;
+
+  while ((n = read(fd, u.buf, sizeof u.buf)) > 0) {
+    for (char *p = u.buf; p < u.buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      if ((ev->wd == tz.file_wd && !(ev->mask & IN_IGNORED)) ||
+          (ev->wd == tz.dir_wd && ev->len && strcmp(ev->name, "localtime") == 0))
+        changed = 1;
+      p += sizeof *ev + ev->len;
+    }
+  }
+  if (changed) {
+    /* the path may name another file now: watch whatever it is */
+    if (tz.file_wd >= 0)
+      inotify_rm_watch(fd, tz.file_wd);
+    tz.file_wd = inotify_add_watch(fd, TZ_FILE, TZ_FILE_EVENTS);
+    tz_invalidate();
+  }
+  return changed;
+}
+
+void tz_invalidate(void) { tz.valid = 0; }
+
+long tz_offset(time_t t) {
+  if (!tz.valid || t < tz.from || t >= tz.until)
+    tz_refresh(t);
+  return tz.gmtoff;
+}
+
+time_t tz_next_change(time_t t) {
+  tz_offset(t);
+  return tz.until;
+}
+
+/* localtime_r() from the cached offset */
+void tz_localtime(time_t t, struct tm *tm) {
+  long long local = (long long)t + tz_offset(t);
+  long long days = floor_div(local, DAY), y;
+  long sod = (long)(local - days * DAY);
+  int m, d;
+
+  civil_from_days(days, &y, &m, &d);
+  memset(tm, 0, sizeof *tm);
+  tm->tm_year = (int)(y - 1900);
+  tm->tm_mon = m - 1;
+  tm->tm_mday = d;
+  tm->tm_hour = (int)(sod / 3600);
+  tm->tm_min = (int)(sod / 60 % 60);
+  tm->tm_sec = (int)(sod % 60);
+  tm->tm_wday = (int)((days % 7 + 11) % 7); /* 1970-01-01 was a Thursday */
+  tm->tm_yday = (int)(days - days_from_civil(y, 1, 1));
+  tm->tm_isdst = tz.isdst;
+  tm->tm_gmtoff = tz.gmtoff;
+  tm->tm_zone = tz.zone;
+}
+
+enum { OpLit, OpNum, OpName, OpStr };
+enum { FYear, FYear2, FCentury, FMonth, FMday, FHour, FHour12, FMin, FSec, FYday, FWday1, FWday };
+enum { NWdayAbbr, NWday, NMonAbbr, NMon, NAmPm, NAmPmLower, NLast };
+
+typedef struct {
+  unsigned char op, field, width;
+  char pad;                /* '0', ' ', or 0 for none */
+  unsigned short off, len; /* OpLit: the text, OpStr: the conversion spec */
+  int unit;                /* seconds between possible changes */
+  /* OpStr: last output, valid for one unit of local time */
+  long long key;
+  unsigned long gen;
+  int have;
+  size_t outlen;
+  char out[TIMEFMT_LINE];
+} TimeOp;
+
+struct TimeFmt {
+  TimeOp ops[TIMEFMT_OPS];
+  int nops;
+  char pool[TIMEFMT_POOL];
+  unsigned short npool;
+  struct {
+    unsigned short off, len;
+  } names[NLast][12];
+  int unit; /* finest unit of any op: the line as a whole is reused within it */
+  long long key;
+  unsigned long gen;
+  int have;
+  size_t len;
+  char line[TIMEFMT_LINE];
+};
+
+static int pool_add(TimeFmt *f, const char *s, size_t len, unsigned short *off) {
+  if (len > sizeof f->pool - f->npool)
+    return 0;
+  memcpy(f->pool + f->npool, s, len);
+  *off = f->npool;
+  f->npool += (unsigned short)len;
+  return 1;
+}
+
+static TimeOp *op_add(TimeFmt *f, int op, int unit) {
+  if (f->nops == TIMEFMT_OPS)
+    return NULL;
+  TimeOp *o = &f->ops[f->nops++];
+  o->op = (unsigned char)op;
+  o->unit = unit;
+  f->unit = MIN(f->unit, unit);
+  return o;
+}
+
+static int lit_add(TimeFmt *f, const char *s, size_t len) {
+  TimeOp *o;
+  if (len == 0)
+    return 1;
+  if (!(o = op_add(f, OpLit, DAY)) || !pool_add(f, s, len, &o->off))
+    return 0;
+  o->len = (unsigned short)len;
+  return 1;
+}
+
+/* Seconds a conversion libc renders for us can stay the same */
+static int conv_unit(char c) {
+  if (strchr("MR", c))
+    return 60;
+  if (strchr("HIklpPzZ", c))
+    return 3600;
+  if (strchr("aAbBCdDeFgGhjmntuUVwWxyY%", c))
+    return DAY;
+  return 1;
+}
+
+static int compile(TimeFmt *f, const char *fmt) {
+  static const struct {
+    char conv;
+    unsigned char field, width;
+    char pad;
+    int unit;
+  } nums[] = {
+      {'Y', FYear, 1, '0', DAY},    {'y', FYear2, 2, '0', DAY}, {'C', FCentury, 2, '0', DAY},
+      {'m', FMonth, 2, '0', DAY},   {'d', FMday, 2, '0', DAY},  {'e', FMday, 2, ' ', DAY},
+      {'H', FHour, 2, '0', 3600},   {'k', FHour, 2, ' ', 3600}, {'I', FHour12, 2, '0', 3600},
+      {'l', FHour12, 2, ' ', 3600}, {'M', FMin, 2, '0', 60},    {'S', FSec, 2, '0', 1},
+      {'j', FYday, 3, '0', DAY},    {'u', FWday1, 1, '0', DAY}, {'w', FWday, 1, '0', DAY},
+  };
+  static const struct {
+    char conv;
+    unsigned char table;
+    int unit;
+  } names[] = {
+      {'a', NWdayAbbr, DAY}, {'A', NWday, DAY}, {'b', NMonAbbr, DAY},       {'h', NMonAbbr, DAY},
+      {'B', NMon, DAY},      {'p', NAmPm, 3600}, {'P', NAmPmLower, 3600},
+  };
+  static const struct {
+    char conv;
+    const char *fmt;
+  } composites[] = {
+      {'T', "%H:%M:%S"}, {'R', "%H:%M"}, {'D', "%m/%d/%y"}, {'F', "%Y-%m-%d"},
+  };
+  const char *p = fmt;
+
+  while (*p) {
+    const char *lit = p;
+    while (*p && *p != '%')
+      p++;
+    if (!lit_add(f, lit, (size_t)(p - lit)))
+      return 0;
+    if (!*p)
+      break;
+
+    const char *spec = p++;
+    char pad = 0; /* flag: 1 for no padding, else the pad character */
+    int plain = 1; /* no flags, width or modifier libc has to interpret */
+    if (*p == '-' || *p == '_' || *p == '0') {
+      pad = *p == '-' ? 1 : *p == '_' ? ' ' : '0';
+      p++;
+    }
+    while (*p && strchr("_-0^#", *p)) {
+      plain = 0;
+      p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+      plain = 0;
+      p++;
+    }
+    if (*p == 'E' || *p == 'O') {
+      plain = 0;
+      p++;
+    }
+    if (!*p)
+      return lit_add(f, spec, (size_t)(p - spec));
+    char c = *p++;
+    int done = 0;
+
+    if (plain && !pad && (c == '%' || c == 'n' || c == 't')) {
+      if (!lit_add(f, c == '%' ? "%" : c == 'n' ? "\n" : "\t", 1))
+        return 0;
+      done = 1;
+    }
+    for (size_t i = 0; plain && !pad && i < LENGTH(composites) && !done; i++) {
+      if (composites[i].conv != c)
+        continue;
+      if (!compile(f, composites[i].fmt))
+        return 0;
+      done = 1;
+    }
+    for (size_t i = 0; plain && i < LENGTH(nums) && !done; i++) {
+      TimeOp *o;
+      if (nums[i].conv != c)
+        continue;
+      if (!(o = op_add(f, OpNum, nums[i].unit)))
+        return 0;
+      o->field = nums[i].field;
+      o->width = nums[i].width;
+      o->pad = pad == 1 ? 0 : pad ? pad : nums[i].pad;
+      done = 1;
+    }
+    for (size_t i = 0; plain && !pad && i < LENGTH(names) && !done; i++) {
+      TimeOp *o;
+      if (names[i].conv != c)
+        continue;
+      if (!(o = op_add(f, OpName, names[i].unit)))
+        return 0;
+      o->field = names[i].table;
+      done = 1;
+    }
+    if (!done) {
+      /* anything else is rendered by strftime and cached for its unit */
+      TimeOp *o = op_add(f, OpStr, conv_unit(c));
+      unsigned short nul;
+      if (!o || !pool_add(f, spec, (size_t)(p - spec), &o->off) || !pool_add(f, "", 1, &nul))
+        return 0;
+      o->len = (unsigned short)(p - spec);
+    }
+  }
+  return 1;
+}
+
+/* Weekday, month and AM/PM names in the current locale */
+static int names_render(TimeFmt *f) {
+  static const char *const convs[NLast] = {"%a", "%A", "%b", "%B", "%p", "%P"};
+  static const int counts[NLast] = {7, 7, 12, 12, 2, 2};
+  char buf[TIMEFMT_LINE];
+  struct tm tm;
+
+  for (int t = 0; t < NLast; t++) {
+    for (int i = 0; i < counts[t]; i++) {
+      memset(&tm, 0, sizeof tm);
+      tm.tm_mday = 1;
+      tm.tm_year = 100;
+      tm.tm_wday = i;
+      tm.tm_mon = i;
+      tm.tm_hour = i * 12;
+      size_t len = strftime(buf, sizeof buf, convs[t], &tm);
+      if (!pool_add(f, buf, len, &f->names[t][i].off))
+        return 0;
+      f->names[t][i].len = (unsigned short)len;
+    }
+  }
+  return 1;
+}
+
+TimeFmt *timefmt_compile(const char *fmt) {
+  TimeFmt *f = ecalloc(1, sizeof *f);
+
+  f->unit = DAY;
+  if (!names_render(f) || !compile(f, fmt)) {
+    free(f);
+    return NULL;
+  }
+  return f;
+}
+
+void timefmt_free(TimeFmt *f) { free(f); }
+
+/* Seconds between possible changes of f's output, at local time boundaries:
+ * what the caller's wakeups need to follow */
+int timefmt_unit(const TimeFmt *f) { return f->unit; }
+
+static int put(char *out, size_t *len, const char *s, size_t n) {
+  if (n >= TIMEFMT_LINE - *len)
+    return 0;
+  memcpy(out + *len, s, n);
+  *len += n;
+  return 1;
+}
+
+static int put_num(char *out, size_t *len, long long v, int width, char pad) {
+  char buf[24];
+  int n = 0, neg = v < 0;
+  unsigned long long u = neg ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+
+  do {
+    buf[sizeof buf - 1 - n++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (neg)
+    buf[sizeof buf - 1 - n++] = '-';
+  while (pad && n < width)
+    buf[sizeof buf - 1 - n++] = pad;
+  return put(out, len, buf + sizeof buf - n, (size_t)n);
+}
+
+static long long field_value(const struct tm *tm, int field) {
+  long long year = tm->tm_year + 1900LL;
+  switch (field) {
+  case FYear:
+    return year;
+  case FYear2:
+    return (year % 100 + 100) % 100;
+  case FCentury:
+    return floor_div(year, 100);
+  case FMonth:
+    return tm->tm_mon + 1;
+  case FMday:
+    return tm->tm_mday;
+  case FHour:
+    return tm->tm_hour;
+  case FHour12:
+    return tm->tm_hour % 12 ? tm->tm_hour % 12 : 12;
+  case FMin:
+    return tm->tm_min;
+  case FSec:
+    return tm->tm_sec;
+  case FYday:
+    return tm->tm_yday + 1;
+  case FWday1:
+    return tm->tm_wday ? tm->tm_wday : 7;
+  default:
+    return tm->tm_wday;
+  }
+}
+
+/* strftime() of the compiled format at t. Like strftime, returns 0 when the
+ * result does not fit into size. */
+size_t timefmt_format(TimeFmt *f, char *buf, size_t size, time_t t) {
+  long long local = (long long)t + tz_offset(t);
+  long long key = floor_div(local, f->unit);
+  struct tm tm;
+  size_t len = 0;
+
+  if (!f->have || f->key != key || f->gen != tz.gen) {
+    tz_localtime(t, &tm);
+    for (int i = 0; i < f->nops; i++) {
+      TimeOp *o = &f->ops[i];
+      int ok = 1;
+      switch (o->op) {
+      case OpLit:
+        ok = put(f->line, &len, f->pool + o->off, o->len);
+        break;
+      case OpNum:
+        ok = put_num(f->line, &len, field_value(&tm, o->field), o->width, o->pad);
+        break;
+      case OpName: {
+        int idx = o->field <= NWday ? tm.tm_wday : o->field <= NMon ? tm.tm_mon : tm.tm_hour >= 12;
+        ok = put(f->line, &len, f->pool + f->names[o->field][idx].off,
+                 f->names[o->field][idx].len);
+      } break;
+      case OpStr: {
+        long long okey = floor_div(local, o->unit);
+        if (!o->have || o->key != okey || o->gen != tz.gen) {
+          o->outlen = strftime(o->out, sizeof o->out, f->pool + o->off, &tm);
+          o->key = okey;
+          o->gen = tz.gen;
+          o->have = 1;
+        }
+        ok = put(f->line, &len, o->out, o->outlen);
+      } break;
+      }
+      if (!ok) {
+        f->have = 0;
+        return 0;
+      }
+    }
+    f->line[len] = '\0';
+    f->len = len;
+    f->key = key;
+    f->gen = tz.gen;
+    f->have = 1;
+  }
+  if (f->len == 0 || f->len >= size)
+    return 0;
+  memcpy(buf, f->line, f->len + 1);
+  return f->len;
+}
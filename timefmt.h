@@ -0,0 +1,19 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Local time off the libc hot path: the UTC offset and the instant it next
+ * changes are cached until that instant or until /etc/localtime changes,
+ * and strftime formats are compiled once into ops that mostly write digits
+ * and names rendered at startup. */
+typedef struct TimeFmt TimeFmt;
+
+int tz_watch(void);
+int tz_handle(int fd);
+void tz_invalidate(void);
+long tz_offset(time_t t);
+time_t tz_next_change(time_t t);
+void tz_localtime(time_t t, struct tm *tm);
+
+TimeFmt *timefmt_compile(const char *fmt);
+size_t timefmt_format(TimeFmt *f, char *buf, size_t size, time_t t);
+int timefmt_unit(const TimeFmt *f);
+void timefmt_free(TimeFmt *f);